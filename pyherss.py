@@ -85,5 +85,39 @@ if __name__ == "__main__":
     vf = herss.rs.CalcVF(restprice)
 
     print("New ValueFunction = ", vf)
+
+    # Evaluate many action schedules in parallel. The actions are stored as [K][stps][n_action_nodes]
+    # and the threads used are set with NR_THREADS in the global file (0 = all cores).
+    K = 8
+    n_action_nodes = herss.gc.n_action_nodes
+    actions = np.random.uniform(0.0, 1.0, size=(K, herss.stps, n_action_nodes))
+    vf_batch = np.zeros(K)
+    herss.SimulateBatch(K, actions.ravel(), vf_batch)
+    print("Batch ValueFunctions = ", vf_batch)
+
+    # Branch from the middle of the planning horizon. SaveState(t) stores the state at the start of
+    # timestep t, and every RestoreState(handle) + SimulateRange(t, stps) gives a new rollout from there.
+    # With VF_ONLY 1 in the global file the series needed for this are not stored. Then SimulateRange 
+    # returns -1 and SaveState returns Herss.NO_HANDLE, and only Simulate() can be used. 
+    # Reprice and GetReservoirLevel_fr stop the program with VF_ONLY.
+    t_mid = herss.stps // 2
+    if herss.SimulateRange(0, t_mid) == 0:
+        handle = herss.SaveState(t_mid)
+        for rollout in range(3):
+            for t in range(t_mid, herss.stps):
+                herss.SetAction(1, t, np.random.uniform(0.0, 1.0))
+            herss.RestoreState(handle)
+            herss.SimulateRange(t_mid, herss.stps)
+            print("Rollout ", rollout, " ValueFunction = ", herss.rs.CalcVF(restprice))
+    else:
+        print("No rollouts, since VF_ONLY is set")
+
+    # Look up whole arrays in the curves. Values outside the curve are clamped, and the number 
+    # of clamped values is returned. Here the turbine efficiency [%] of the first powerstation.
+    ps = herss.rs.pstations[0]
+    Q = np.linspace(0.0, ps.powstat_max_discharge, 100)
+    efficiency = np.zeros(len(Q))
+    nr_clamped = ps.ac_turbvirkn_curve.x2y_batch(Q, efficiency, len(Q))
+    print("Turbine efficiency at max discharge = ", efficiency[-1], " clamped = ", nr_clamped)
     print("THE-END")
 #---------------------------------------------------
@@ -42,6 +42,12 @@ double ArrayCurve::initializeArrays() {
     xmin = ymin =  99999999.9;
     xmax = ymax = -999999999.9;
 
+    if(nr_pts > CURVE_MAX_POINTS) {
+        printf("ERROR: nr_pts=%d > CURVE_MAX_POINTS=%d\n", nr_pts, CURVE_MAX_POINTS);
+        printf("file: %s  linenr: %d  function: %s \n", __FILE__ , __LINE__, __FUNCTION__);
+        exit(EXIT_FAILURE);
+    }
+
     for(int i = 0; i < nr_pts; i++) {
 
         if( x_points[i] > xmax) {
@@ -61,48 +67,59 @@ double ArrayCurve::initializeArrays() {
         }
     }
 
-    // Now we normalize both axis [0,1]
-    for(int i = 0; i < nr_pts; i++) {
-        x_points[i]  = (x_points[i] - xmin) / (xmax - xmin);
-        y_points[i]  = (y_points[i] - ymin) / (ymax - ymin);
+    // Curves that are not in use (nr_pts = -9999 etc.) are never looked up.
+    if(nr_pts < 2) {
+        step_scale = 0.0;
+        for(int t = 0; t <= POINTS_IN_ARRAY; t++) {
+            step_seg[t] = 0;
+        }
+        return 0.0;
     }
 
-    xlower[0] = x_points[0];
-    ylower[0] = y_points[0];
-    xupper[0] = x_points[1];
-    yupper[0] = y_points[1];
+    for(int i = 0; i < nr_pts - 1; i++) {
+        double dx = x_points[i+1] - x_points[i];
+        if(dx > 0.0) {
+            slope[i]     = (y_points[i+1] - y_points[i]) / dx;
+            intercept[i] = y_points[i] - slope[i] * x_points[i];
+        } else {
+            // A vertical step, we use the upper point.
+            slope[i]     = 0.0;
+            intercept[i] = y_points[i+1];
+        }
+    }
 
+    // The segment in each step is found on the normalized x axis [0,1], with the same 
+    // stepping as the first version of the class.
+    double x_norm[CURVE_MAX_POINTS];
+    for(int i = 0; i < nr_pts; i++) {
+        x_norm[i] = (x_points[i] - xmin) / (xmax - xmin);
+    }
+    step_seg[0] = 0;
     int idx_points = 0;
-    double dx = (x_points[nr_pts-1] - x_points[0])/double(POINTS_IN_ARRAY);
+    double dx = (x_norm[nr_pts-1] - x_norm[0])/double(POINTS_IN_ARRAY);
     double x;
     for(int t = 1; t < POINTS_IN_ARRAY; t++) {
-        x = x_points[0] + double(t)*dx;
-        if(x >= x_points[idx_points+1]){
+        x = x_norm[0] + double(t)*dx;
+        if(x >= x_norm[idx_points+1]){
             idx_points++;
         }
-        xlower[t] = x_points[idx_points];
-        ylower[t] = y_points[idx_points];
-        xupper[t] = x_points[idx_points+1];
-        yupper[t] = y_points[idx_points+1];
+        step_seg[t] = (unsigned char) idx_points;
     }
+    step_seg[POINTS_IN_ARRAY] = (unsigned char) (nr_pts - 2);
+
+    step_scale = double(POINTS_IN_ARRAY) / (xmax - xmin);
     return 0.0;
 }
 ///////////////////////////////////////////////////////////////////////////
-//
-// BUG: Fix later.
-// When the flow is at maximum. We are at the upper end of the efficiency curves.
-// The current method have a numerical problem with it.
-// The quick solution is to make the curves go to a tiny fraction above max flow.
-// We have to look at this later
-double ArrayCurve::x2y(double x) {
-
-    double xt = x + 0.0;
-
-    xt = (x-xmin)/(xmax-xmin);
-
-    if(xt > 1.0 || xt < 0.0) {
-        printf("ERROR with normalization   [0,1]\n");
-        printf("xt=%.8f\n", xt );
+// Linear interpolation between the points. x outside [xmin, xmax] is an error.
+// The first version had a BUG at maximum flow, at the upper end of the efficiency curves: 
+// The last half step rounded to index POINTS_IN_ARRAY, outside the tables. 
+// step_seg has one extra step for this, using the last segment. 
+double ArrayCurve::x2y(double x) const {
+
+    if(x > xmax || x < xmin || !(nr_pts >= 2)) {
+        printf("ERROR x outside the curve [%.8f, %.8f]\n", xmin, xmax);
+        printf("x=%.8f\n", x );
         for(int i = 0; i < nr_pts; i++) {
             printf("%d x_points[i]=%.5f  y_points[i]=%.5f\n", i, x_points[i], y_points[i]);
         }
@@ -110,24 +127,79 @@ double ArrayCurve::x2y(double x) {
 		exit(EXIT_FAILURE);
     }
 
-    int idx;
-    idx = int(  0.5 +  ( xt - x_points[0]) / (x_points[nr_pts-1] - x_points[0]) * double(POINTS_IN_ARRAY)) ;
+    int s = step_seg[int(0.5 + (x - xmin) * step_scale)];
+    return intercept[s] + slope[s] * x;
+}
+///////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////
+// Same as x2y, but for HERSS_LANES values at the time. 
+// The range check is done first, so the loop doing the interpolation has no branches.
+void ArrayCurve::x2y_lanes(const double *x, double *y) const {
+
+    int seg[HERSS_LANES];
+
+    for(int l = 0; l < HERSS_LANES; l++) {
+        if(x[l] > xmax || x[l] < xmin || !(nr_pts >= 2)) {
+            printf("ERROR x outside the curve [%.8f, %.8f]\n", xmin, xmax);
+            printf("lane=%d  x=%.8f\n", l, x[l] );
+            for(int i = 0; i < nr_pts; i++) {
+                printf("%d x_points[i]=%.5f  y_points[i]=%.5f\n", i, x_points[i], y_points[i]);
+            }
+            printf("file: %s  linenr: %d  function: %s \n", __FILE__ , __LINE__, __FUNCTION__);
+            exit(EXIT_FAILURE);
+        }
+    }
 
-    if(xt < x_points[0] || xt > x_points[nr_pts-1]) {
-        printf("HOUSTON - we have a problem!\n");
-        printf("x=%.3f\n", xt);
-        printf("idx = %d\n", idx);
-        printf("file: %s  linenr: %d  function: %s \n", __FILE__ , __LINE__, __FUNCTION__);
-		exit(EXIT_FAILURE);
+    for(int l = 0; l < HERSS_LANES; l++) {
+        seg[l] = step_seg[int(0.5 + (x[l] - xmin) * step_scale)];
     }
 
-    double y;
-    double slope;
-    slope = (yupper[idx] - ylower[idx]) / ( xupper[idx] - xlower[idx] );
-    y = slope * (xt- xlower[idx]) +  ylower[idx];
+    for(int l = 0; l < HERSS_LANES; l++) {
+        y[l] = intercept[seg[l]] + slope[seg[l]] * x[l];
+    }
+}
+///////////////////////////////////////////////////////////////////////////
+// x2y for n values, used for whole series in post-processing and ensembles. 
+// Values outside [xmin, xmax] (and NaN) are clamped to the curve instead of stopping the program, 
+// and the number of clamped values is returned. Inside the curve y is the same as from x2y.
+// Each block is done in separate loops without branches. The clamping, the step and the 
+// multiply-add are vectorized by the compiler (SSE2, or AVX2 with -march=native), and the 
+// two lookups in the small tables stay in L1 cache.
+size_t ArrayCurve::x2y_batch(const double *x, double *y, size_t n) const {
+
+    if(nr_pts < 2) {
+        for(size_t k = 0; k < n; k++) {
+            y[k] = 0.0;
+        }
+        return n;
+    }
 
-    // De-Normalize
-    y = y * (ymax-ymin) + ymin;
-    return y;
+    double xc[CURVE_BATCH_BLOCK];
+    int idx[CURVE_BATCH_BLOCK];
+    size_t nr_clamped = 0;
+
+    for(size_t k0 = 0; k0 < n; k0 += CURVE_BATCH_BLOCK) {
+        size_t m = n - k0 < CURVE_BATCH_BLOCK ? n - k0 : CURVE_BATCH_BLOCK;
+        const double *xb = x + k0;
+        double *yb = y + k0;
+
+        for(size_t j = 0; j < m; j++) {
+            double v = xb[j];
+            v = v >= xmin ? v : xmin;  // NaN also ends up at xmin
+            v = v <= xmax ? v : xmax;
+            xc[j]  = v;
+            idx[j] = int(0.5 + (v - xmin) * step_scale);
+        }
+        for(size_t j = 0; j < m; j++) {
+            nr_clamped += (xc[j] != xb[j]);
+        }
+        for(size_t j = 0; j < m; j++) {
+            idx[j] = step_seg[idx[j]];
+        }
+        for(size_t j = 0; j < m; j++) {
+            yb[j] = intercept[idx[j]] + slope[idx[j]] * xc[j];
+        }
+    }
+    return nr_clamped;
 }
 ///////////////////////////////////////////////////////////////////////////
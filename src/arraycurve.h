@@ -30,17 +30,31 @@ SOFTWARE.
 #ifndef __ARRAYCURVE_h__
 #define __ARRAYCURVE_h__
 
+#include <stddef.h>
+
 #define POINTS_IN_ARRAY 1000
+// Most points in a curve, the same as MAX_NR_POINTS_CURVE in herss.h
+#define CURVE_MAX_POINTS 50
+// x2y_batch works on blocks of this many values, small enough to stay in L1 cache.
+#define CURVE_BATCH_BLOCK 256
 //---------------------------------------------
 // The idea here is that we want to make a super fast calculation of Y from a curve
 // defined by pairs of (x,y).
 // We already have a method to do this with PointCurve, but a profiling of the HERSS code showed
 // that more than 30 % of the calculations were spent doing interpolation on the point curves.
 // This class tries to model the same thing using static curves.
-// We do this by defining an upper and a lower array.
-// We discretisize the x axes into small steps. For each of these we point to the lower and upper (nearest values of Y and X. )
-// The trick is to normalize both axis to values between zero and one.
-// WORK IN PROGRESS, BVM Feb 2024. 
+// We discretisize the x axes into POINTS_IN_ARRAY small steps, and for each step we store 
+// the segment (between two points) used in that step. The slope and intercept of every 
+// segment are calculated when the curve is initialized, so a lookup is a multiply to find 
+// the step, and a multiply-add. There is no division, and a curve uses less than 2 KB. 
+// Near a point the step may use the neighbouring segment, this is the same as in the first 
+// version of the class that stored the points around every step in four tables of 8 KB each.
+//
+// Tolerance: The results are the same as the first version within about 1e-12 relative 
+// to the largest |y| in the curve, since the line is now calculated in the original units 
+// and not on normalized axis. The exception is the last half step up to xmax, where the 
+// first version read outside its tables (see ArrayCurve::x2y), and at exactly half a step 
+// where the rounding to a step can differ in the last bit.
 
 class ArrayCurve {
 
@@ -50,15 +64,17 @@ public:
 
 	double xmin, xmax;
 	double ymin, ymax;
-	double x_points[POINTS_IN_ARRAY];  // We copy over the data from the OVERFLOW CURVE, etc.
-	double y_points[POINTS_IN_ARRAY];
+	double x_points[CURVE_MAX_POINTS];  // We copy over the data from the OVERFLOW CURVE, etc.
+	double y_points[CURVE_MAX_POINTS];
 	int nr_pts;  // Number of points used in the array
-	double xupper[POINTS_IN_ARRAY];
-	double xlower[POINTS_IN_ARRAY];
-	double yupper[POINTS_IN_ARRAY];
-	double ylower[POINTS_IN_ARRAY];
+	double slope[CURVE_MAX_POINTS];      // y = intercept[s] + slope[s]*x in segment s, between point s and s+1
+	double intercept[CURVE_MAX_POINTS];
+	unsigned char step_seg[POINTS_IN_ARRAY+1];  // The segment used in each step. The last one is for x near xmax.
+	double step_scale;                   // POINTS_IN_ARRAY/(xmax - xmin)
 	double initializeArrays();
-	double x2y(double x);  // We use this to get y from x for the curve that was used to initialize.
+	double x2y(double x) const;  // We use this to get y from x for the curve that was used to initialize.
+	void x2y_lanes(const double *x, double *y) const;  // The same for HERSS_LANES values of x.
+	size_t x2y_batch(const double *x, double *y, size_t n) const;  // n values, x outside the curve is clamped. Returns nr clamped.
 };
 
 #endif
@@ -34,7 +34,6 @@ Channel::Channel(){
     traveltime         = NOT_INIT;
     decay              = NOT_INIT;
     for(size_t t = 0; t < MAX_TRAVELTIME_HOURS; t++) {
-        waterflow_m3[t]        = NOT_INIT;
         init_waterflow_m3[t]   = NOT_INIT;
     }
 }
@@ -49,21 +48,17 @@ int Channel::initArrayCurves(void) {
 void Channel::PrintChannelWater(void){
     printf ("NODE CHANNEL %d %s\n", int(idnr) , nodename.c_str() );
     for(size_t t = 0; t <  this->traveltime; t++ ) {  
-        printf("waterflow_m3[%lu] = %.5f\n", t, waterflow_m3[t]);
+        printf("waterflow_m3[%lu] = %.5f\n", t, X->waterflow_m3[Part(X->channel_head, t)]);
     }
 }
 //----------------------------------------------------------------------
 
 
-int Channel::Simulate(size_t t) {
+int Channel::Simulate(size_t t, SystemState *Y) const {
 
-    double sum_storage_m3;
-    this->dt     = S->dt;
-    this->stps   = S->stps;
-
-    double out[MAX_TRAVELTIME_HOURS];  // Helpers 
-    double in[MAX_TRAVELTIME_HOURS];   // Helpers
-    S->channel_storage_Mm3[t] = 0.0; // To void warnings. 
+    NodeState *x = &Y->ns[idnr];
+    Scenario *S  = x->S;
+    size_t ts = t & S->mask;  // Where timestep t is stored in the output series
 
     if(this->traveltime < 0) {
         printf("CHANNEL   traveltime < 0   ERROR\n");
@@ -72,74 +67,232 @@ int Channel::Simulate(size_t t) {
 		exit(EXIT_FAILURE);
     }
 
-    // We have to cases.  A: no storage or decay. B: Storage and decay. 
+    // We have three cases.  A: no storage or decay. B: Storage without decay. C: Storage and decay. 
     if(this->traveltime == 0) {
-        sum_storage_m3 = 0.0;
-        waterflow_m3[0] = 0.0;
-        S->tot_outflow[t] = S->up_inflow[t];
+        x->waterflow_m3[0] = 0.0;
+        x->channel_storage_m3 = 0.0;
+        S->tot_outflow[ts] = S->up_inflow[ts];
 
-        if(this->downstream_node_in_use) {
-            this->ptr_downstream_node->S->up_inflow[t] += S->tot_outflow[t];
-        }
+    } else if(this->decay == 1.0) {
+        // All the water moves one part down, so instead of moving it we let the part that 
+        // leaves the channel become the new first part. Only the storage total is updated.
+        size_t last   = Part(x->channel_head, traveltime-1);
+        double out_m3 = x->waterflow_m3[last];
+        S->tot_outflow[ts] = out_m3*decay/S->dt; // m3/s
 
-        S->channel_storage_Mm3[t] = 0.0;
+        x->waterflow_m3[last]  = S->up_inflow[ts] * dt;
+        x->channel_head        = last;
+        x->channel_storage_m3 += x->waterflow_m3[last] - out_m3;
 
     } else {
+        // Every part changes. The water going into part s is the water leaving part s-1, 
+        // so one pass from the top of the channel is enough, and we sum the storage on the way.
+        double in_m3  = S->up_inflow[ts] * dt;
+        double sum_storage_m3 = 0.0;
+        S->tot_outflow[ts] = x->waterflow_m3[traveltime-1]*decay/S->dt; // m3/s
 
-        sum_storage_m3 = 0.0;
-        for(size_t s = 0; s <  this->traveltime; s++ ) {  
-            sum_storage_m3 += waterflow_m3[s];  
+        for(size_t s = 0; s < traveltime; s++) {
+            double out_m3 = x->waterflow_m3[s] * decay;
+            x->waterflow_m3[s] = x->waterflow_m3[s] + in_m3 - out_m3;
+            in_m3 = out_m3;
+            sum_storage_m3 += x->waterflow_m3[s];
         }
-    
-        S->tot_outflow[t] = waterflow_m3[traveltime-1]*decay/S->dt; // m3/s
+        x->channel_storage_m3 = sum_storage_m3;
+    }
 
-        // Calculate the incoming water and do not update yet. 
-        for(size_t s = 0; s < traveltime; s++) {
-            in[s] = S->up_inflow[t] * dt;
-            if(s > 0) {
-                in[s] = waterflow_m3[s-1] * decay;
-            }
+    if(this->downstream_node_in_use) {
+        Y->scen[downstream_idnr]->up_inflow[ts] += S->tot_outflow[ts];
+    }
+    S->channel_storage_Mm3[ts] = x->channel_storage_m3 / 1000000.0;  // Mm3
+
+    x->remaining_available_Mm3 = S->channel_storage_Mm3[ts];
+    if(x->remaining_available_Mm3 < 0.0) {
+        x->remaining_available_Mm3 = 0.0; // Used to calculate remaining available energy in system. Cannot be negative.
+    }
+
+    return 0;
+}
+//////////////////////////////////////////////////////////////////////
+// The same calculations as Simulate(t, Y) for all of [t0,t1), when up_inflow is known for 
+// the whole period. The channel is linear, so we can take one part of the channel at a time 
+// over the whole period instead of one timestep at a time. The numbers are the same as 
+// when we simulate one timestep at a time.
+int Channel::SimulateSeries(size_t t0, size_t t1, SystemState *Y) const {
+
+    NodeState *x = &Y->ns[idnr];
+    Scenario *S  = x->S;
+    if(t1 <= t0) {
+        return 0;
+    }
+    size_t n = t1 - t0;
+    double *up_inflow   = S->up_inflow + t0;
+    double *tot_outflow = S->tot_outflow + t0;
+    double *storage     = S->channel_storage_Mm3 + t0;
+
+    if(this->traveltime == 0) {
+        for(size_t k = 0; k < n; k++) {
+            tot_outflow[k] = up_inflow[k];
+            storage[k]     = 0.0;
+        }
+        x->waterflow_m3[0] = 0.0;
+        x->channel_storage_m3 = 0.0;
+
+    } else if(this->decay == 1.0) {
+        // The outflow is the inflow traveltime steps earlier, first from the water in the channel.
+        size_t T = traveltime;
+        for(size_t k = 0; k < n; k++) {
+            double out_m3 = (k < T) ? x->waterflow_m3[Part(x->channel_head, T-1-k)] : up_inflow[k-T] * dt;
+            tot_outflow[k] = out_m3*decay/S->dt; // m3/s
+            x->channel_storage_m3 += up_inflow[k] * dt - out_m3;
+            storage[k] = x->channel_storage_m3 / 1000000.0;  // Mm3
         }
 
-        // Calculate the outgoing water and do not update yet. 
-        for(size_t s = 0; s < traveltime; s++) {
-            out[s] = waterflow_m3[s] * decay;
+        double water_m3[MAX_TRAVELTIME_HOURS];
+        for(size_t s = 0; s < T; s++) {
+            water_m3[s] = (s < n) ? up_inflow[n-1-s] * dt : x->waterflow_m3[Part(x->channel_head, s-n)];
         }
+        for(size_t s = 0; s < T; s++) {
+            x->waterflow_m3[s] = water_m3[s];
+        }
+        x->channel_head = 0;
 
-        // Now we update 
+    } else {
+        // tot_outflow holds the water going into the current part of the channel, and 
+        // storage the sum of the parts done so far [m3]. 
+        for(size_t k = 0; k < n; k++) {
+            tot_outflow[k] = up_inflow[k] * dt;
+            storage[k]     = 0.0;
+        }
         for(size_t s = 0; s < traveltime; s++) {
-            waterflow_m3[s]  = waterflow_m3[s] + in[s] - out[s];
+            double water_m3 = x->waterflow_m3[s];
+            for(size_t k = 0; k < n; k++) {
+                double out_m3  = water_m3 * decay;
+                water_m3       = water_m3 + tot_outflow[k] - out_m3;
+                tot_outflow[k] = out_m3;
+                storage[k]    += water_m3;
+            }
+            x->waterflow_m3[s] = water_m3;
         }
-
-        if(this->downstream_node_in_use) {
-            this->ptr_downstream_node->S->up_inflow[t] += S->tot_outflow[t];
+        x->channel_storage_m3 = storage[n-1];
+        for(size_t k = 0; k < n; k++) {
+            tot_outflow[k] = tot_outflow[k]/S->dt;  // m3/s
+            storage[k]     = storage[k] / 1000000.0;  // Mm3
         }
+    }
 
-        sum_storage_m3 = 0.0;
-        for(size_t s = 0; s <  this->traveltime; s++ ) {
-            sum_storage_m3 += waterflow_m3[s];
+    if(this->downstream_node_in_use) {
+        double *down_inflow = Y->scen[downstream_idnr]->up_inflow + t0;
+        for(size_t k = 0; k < n; k++) {
+            down_inflow[k] += tot_outflow[k];
         }
+    }
 
-        S->channel_storage_Mm3[t] = sum_storage_m3 / 1000000.0;  // Mm3
+    x->remaining_available_Mm3 = S->channel_storage_Mm3[t1-1];
+    if(x->remaining_available_Mm3 < 0.0) {
+        x->remaining_available_Mm3 = 0.0;
     }
+    return 0;
+}
+//////////////////////////////////////////////////////////////////////
+// The qmin cost when the outflow is below the requirement.
+void Channel::CalcEconomics(size_t t0, size_t t1, Scenario *S) const {
+    for(size_t t = t0; t < t1; t++) {
+        size_t ts = t & S->mask;
+        S->cost_qmin[ts] = 0.0;
+        S->income[ts]    = 0.0;  // No income in Channels 
+    }
+    if(this->qmin_in_use) {
+        for(size_t t = t0; t < t1; t++) {
+            size_t ts = t & S->mask;
+            S->cost_qmin[ts] = (S->tot_outflow[ts] < qmin.req_series[t]) ? qmin.cost_series[t]*S->dt/3600 : 0.0;
+        }
+    }
+    for(size_t t = t0; t < t1; t++) {
+        size_t ts = t & S->mask;
+        S->cost[ts] = S->cost_qmin[ts];
+    }
+}
+//////////////////////////////////////////////////////////////////////
+int Channel::InitState(LaneState *x) const {
+    Node::InitState(x);
+    x->channel_head = 0;
+    for(size_t l = 0; l < HERSS_LANES; l++) {
+        x->channel_storage_m3[l] = 0.0;
+    }
+    for(size_t s = 0; s < this->traveltime; s++) {
+        for(size_t l = 0; l < HERSS_LANES; l++) {
+            x->waterflow_m3[s][l] = init_waterflow_m3[s];
+            x->channel_storage_m3[l] += init_waterflow_m3[s];
+        }
+    }
+    return 0;
+}
+//////////////////////////////////////////////////////////////////////
+// The same calculations as Simulate(t, Y), but for all lanes in G at the same time.
+int Channel::Simulate(size_t t, LaneGroup *G) const {
 
-    S->cost_qmin[t]  = 0.0;
-    S->income[t]  = 0.0;  // No income in Channels 
+    LaneState *x = &G->ls[idnr];
+    double *income = x->income + t*HERSS_LANES;
+    double *cost   = x->cost   + t*HERSS_LANES;
+    double outflow[HERSS_LANES];
+    double storage_Mm3[HERSS_LANES];
 
-    if(this->qmin_in_use) {
-        double qcost;
-        double qmin_requirements = this->qmin.calcQminRequirement(S->year[t], S->month[t], S->day[t], &qcost);  // m3/s
-        if(S->tot_outflow[t]  < qmin_requirements) {
-            S->cost_qmin[t]  = qcost*S->dt/3600;
+    if(this->traveltime == 0) {
+        for(size_t l = 0; l < HERSS_LANES; l++) {
+            x->waterflow_m3[0][l] = 0.0;
+            x->channel_storage_m3[l] = 0.0;
+            outflow[l] = x->up_inflow[l];
+        }
+    } else if(this->decay == 1.0) {
+        size_t last = Part(x->channel_head, traveltime-1);
+        for(size_t l = 0; l < HERSS_LANES; l++) {
+            double out_m3 = x->waterflow_m3[last][l];
+            outflow[l] = out_m3*decay/dt; // m3/s
+            x->waterflow_m3[last][l]  = x->up_inflow[l] * dt;
+            x->channel_storage_m3[l] += x->waterflow_m3[last][l] - out_m3;
+        }
+        x->channel_head = last;
+    } else {
+        double in_m3[HERSS_LANES];
+        for(size_t l = 0; l < HERSS_LANES; l++) {
+            outflow[l] = x->waterflow_m3[traveltime-1][l]*decay/dt; // m3/s
+            in_m3[l] = x->up_inflow[l] * dt;
+            x->channel_storage_m3[l] = 0.0;
+        }
+        for(size_t s = 0; s < traveltime; s++) {
+            for(size_t l = 0; l < HERSS_LANES; l++) {
+                double out_m3 = x->waterflow_m3[s][l] * decay;
+                x->waterflow_m3[s][l] = x->waterflow_m3[s][l] + in_m3[l] - out_m3;
+                in_m3[l] = out_m3;
+                x->channel_storage_m3[l] += x->waterflow_m3[s][l];
+            }
         }
     }
-    S->cost[t] = S->cost_qmin[t];
+    for(size_t l = 0; l < HERSS_LANES; l++) {
+        storage_Mm3[l] = x->channel_storage_m3[l] / 1000000.0;  // Mm3
+    }
 
-    remaining_available_Mm3 = S->channel_storage_Mm3[t];
-    if(remaining_available_Mm3 < 0.0) {
-        remaining_available_Mm3 = 0.0; // Used to calculate remaining available energy in system. Cannot be negative.
+    if(this->downstream_node_in_use) {
+        LaneState *xd = &G->ls[downstream_idnr];
+        for(size_t l = 0; l < HERSS_LANES; l++) {
+            xd->up_inflow[l] += outflow[l];
+        }
     }
 
+    // The qmin requirement follows the calendar and is the same in all lanes.
+    double qmin_requirements = 0.0;
+    double qcost = 0.0;
+    if(this->qmin_in_use) {
+        qmin_requirements = this->qmin.req_series[t];  // m3/s
+        qcost             = this->qmin.cost_series[t];
+    }
+
+    for(size_t l = 0; l < HERSS_LANES; l++) {
+        cost[l]   = (outflow[l] < qmin_requirements) ? qcost*dt/3600 : 0.0;
+        income[l] = 0.0;  // No income in Channels 
+        x->sum_outflow_Mm3[l] += MACRO_m3s_2_Mm3(outflow[l], dt);
+        x->remaining_available_Mm3[l] = (storage_Mm3[l] < 0.0) ? 0.0 : storage_Mm3[l];
+    }
     return 0;
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -242,20 +395,56 @@ int Channel::ReadNodeData(string filename) {
     return 0;
 }
 ////////////////////////////////////////////////////////////////////////////
-int Channel::SetStartState(void) {
-
-    for(size_t t = 0; t < S->stps; t++ ) {
-        S->up_inflow[t]    = 0.0;
-        //S->inflow[t]       = 0.0;
-    }
+int Channel::InitState(NodeState *x) const {
+    Node::InitState(x);
+    SetStartState(x);
+    return 0;
+}
+////////////////////////////////////////////////////////////////////////////
+int Channel::SetStartState(NodeState *x) const {
 
+    x->channel_head       = 0;
+    x->channel_storage_m3 = 0.0;
     for(size_t t = 0; t <  this->traveltime; t++ ) {
-        waterflow_m3[t]    = init_waterflow_m3[t];
+        x->waterflow_m3[t]    = init_waterflow_m3[t];
+        x->channel_storage_m3 += init_waterflow_m3[t];
     }
 
     return 0;
 }
 ////////////////////////////////////////////////////////////////////////////
+// Part s of the channel is stored at waterflow_m3[Part(channel_head, s)].
+size_t Channel::Part(size_t head, size_t s) const {
+    s += head;
+    return (s < this->traveltime) ? s : s - this->traveltime;
+}
+////////////////////////////////////////////////////////////////////////////
+// The water in transit is stored after the common node state, as it is laid out in the 
+// ring buffer, followed by channel_head and the storage total.
+size_t Channel::StateSize() const {
+    return Node::StateSize() + this->traveltime + 2;
+}
+////////////////////////////////////////////////////////////////////////////
+void Channel::SaveState(size_t t, const NodeState *x, double *buf) const {
+    Node::SaveState(t, x, buf);
+    buf += Node::StateSize();
+    for(size_t s = 0; s < this->traveltime; s++ ) {
+        buf[s] = x->waterflow_m3[s];
+    }
+    buf[traveltime]   = double(x->channel_head);
+    buf[traveltime+1] = x->channel_storage_m3;
+}
+////////////////////////////////////////////////////////////////////////////
+void Channel::RestoreState(size_t t, NodeState *x, const double *buf) const {
+    Node::RestoreState(t, x, buf);
+    buf += Node::StateSize();
+    for(size_t s = 0; s < this->traveltime; s++ ) {
+        x->waterflow_m3[s] = buf[s];
+    }
+    x->channel_head       = size_t(buf[traveltime]);
+    x->channel_storage_m3 = buf[traveltime+1];
+}
+////////////////////////////////////////////////////////////////////////////
 
 int Channel::ReadStateFile(string filename){
     bool found_node = false;
@@ -293,7 +482,6 @@ int Channel::ReadStateFile(string filename){
                         getline(myfile, line);
                         for(size_t t = 0; t <  this->traveltime; t++ ) {
                             value   = line_obj.extractNextElementFromLine(&line);
-                            waterflow_m3[t]        = atof( value.c_str() );
                             init_waterflow_m3[t]   = atof( value.c_str() );
                         }
                     }
@@ -322,13 +510,11 @@ int Channel::CheckWaterBalance(void) {
 
     for(size_t t = 0; t <  this->traveltime; t++ ) {
         start_channel_m3 += init_waterflow_m3[t];
-        end_channel_m3   += waterflow_m3[t];
     }
+    end_channel_m3 = X->channel_storage_m3;
 
-    for(size_t t = 0; t < this->stps; t++) {
-        sum_inflow += MACRO_m3s_2_Mm3( (this->S->inflow[t] + this->S->up_inflow[t]) , dt);
-        sum_outflow += MACRO_m3s_2_Mm3(this->S->tot_outflow[t], dt);
-    }
+    sum_inflow  = this->S->sum_inflow_Mm3;
+    sum_outflow = this->S->sum_outflow_Mm3;
 
     double waterbalance = (start_channel_m3/1000000) + sum_inflow - (end_channel_m3/1000000) - sum_outflow;
 
@@ -368,11 +554,7 @@ double Channel::GetStartWater_Mm3(void) {
 }
 //------------------------------------------------------------------------
 double Channel::GetEndWater_Mm3(void) {
-    double end_channel_m3   = 0.0;
-    for(size_t t = 0; t <  this->traveltime; t++ ) {
-        end_channel_m3   += waterflow_m3[t];
-    }
-    return end_channel_m3/1000000.0;
+    return X->channel_storage_m3/1000000.0;
 }
 //------------------------------------------------------------------------
 int Channel::WriteNodeOutput(GlobalConfig *gc){
@@ -395,7 +577,7 @@ int Channel::WriteNodeOutput(GlobalConfig *gc){
     fprintf(fp, "yyyy mm dd hh [m3/s]    [Mm3]       [m3/s]      [Euro]\n");
     fprintf(fp, "yyyy mm dd hh Up_Inflow Storage_Mm3 tot_outflow Qmin_Cost\n");
     for(size_t t = 0; t < this->stps; t++) {
-        fprintf(fp, "%d %d %d %d ", S->year[t], S->month[t], S->day[t], S->hour[t]);
+        fprintf(fp, "%d %d %d %d ", timeaxis->year[t], timeaxis->month[t], timeaxis->day[t], timeaxis->hour[t]);
         fprintf(fp, "%.4f %.8f ", S->up_inflow[t], S->channel_storage_Mm3[t]);
         fprintf(fp, "%.4f ", S->tot_outflow[t]);
         fprintf(fp, "%.4f ", S->cost[t]);
@@ -406,18 +588,28 @@ int Channel::WriteNodeOutput(GlobalConfig *gc){
     return 0;
 } 
 //------------------------------------------------------------------------
-double Channel::GetTunnelFLow(size_t t) {
+double Channel::GetTunnelFLow(size_t t, SystemState *Y) const {
     printf("ERROR Channel cannot use the function: GetTunnelFLow \n");
     printf("Have you connected a tunnel from a reservoir to a channel? - check input\n");
     printf( "NODE CHANNEL idnr=%d  nodename=%s\n", int(idnr), nodename.c_str()  );
     printf("file: %s  linenr: %d  function: %s \n", __FILE__ , __LINE__, __FUNCTION__);
     exit(EXIT_FAILURE);
 }
+//------------------------------------------------------------------------
+void Channel::GetEndWater_Mm3(LaneState *x, double *water) const {
+    for(size_t l = 0; l < HERSS_LANES; l++) {
+        water[l] += x->channel_storage_m3[l]/1000000.0;
+    }
+}
+//------------------------------------------------------------------------
+void Channel::GetTunnelFLow(size_t t, LaneGroup *G, double *flow) const {
+    GetTunnelFLow(t, G->base);
+}
 //////////////////////////////////////////////////////////////////////////////////
 int Channel::WriteStateFile(FILE *fp) {
     fprintf (fp, "NODE CHANNEL %d %s ", int(idnr) , nodename.c_str() );
     for( size_t s = 0; s < this->traveltime; s++) { 
-        fprintf(fp, "%.5f ", this->waterflow_m3[s]);
+        fprintf(fp, "%.5f ", X->waterflow_m3[Part(X->channel_head, s)]);
     }
     fprintf(fp, "\n");
     return 0;
@@ -28,6 +28,8 @@ SOFTWARE.
 ********************************************************************************/
 
 #include "herss.h"
+#include <filesystem>
+#include <algorithm>
 
 
 /////////////////////////////////////////////////////////////////////////////////////////////////
@@ -37,26 +39,8 @@ Dataset::Dataset(GlobalConfig *gc){
 
     this->stps     = gc->stps;
     this->nr_nodes = gc->nr_nodes;
-    try {
-        inflow  = new double*[stps];
-        action = new double*[stps];
-        for( size_t t = 0; t < stps; ++t ) {
-            inflow[t] = new double[nr_nodes];
-            action[t] = new double[nr_nodes];
-        }
-    }
-    catch(std::bad_alloc& exc) { 
-        printf("Error: memory allocation failed. \n"); 
-        printf("file: %s  linenr: %d   function: %s \n", __FILE__ , __LINE__, __FUNCTION__);
-        exit(EXIT_FAILURE);
-    }
-
-    for(size_t t = 0; t < stps;  t++) {
-        for(size_t n = 0; n < nr_nodes;  n++) {
-            inflow[t][n] = 0.0;  // To make things easyer and faster 
-            action[t][n] = NOT_INIT;
-        }
-    }
+    inflow = NewColumns(0.0);  // To make things easyer and faster 
+    action = NewColumns(NOT_INIT);
 
     try {
         price   = new double[stps];
@@ -79,17 +63,19 @@ Dataset::Dataset(GlobalConfig *gc){
         hour[t]  = NOT_INIT;
     }
 
+    nr_members      = 0;
+    ensemble_inflow = NULL;
+
     readPricefile();
     readInflowFile();
     readActionsFile();
+    if(gc->found_ensemblefilename) {
+        readInflowEnsemble();
+    }
 
 }
 ///////////////////////////////////////////////////////////////////////////////////////////
 Dataset::~Dataset(){
-    for(size_t t = 0; t < stps; t++) {
-        delete [] inflow[t];
-        delete [] action[t];
-    }
     delete [] inflow;
     delete [] action;
     delete [] price;
@@ -98,10 +84,47 @@ Dataset::~Dataset(){
     delete [] day;
     delete [] hour;
 
+    for(size_t m = 0; m < nr_members; m++) {
+        delete [] ensemble_inflow[m];
+    }
+    delete [] ensemble_inflow;
+    for(size_t b = 0; b < column_mem.size(); b++) {
+        delete [] column_mem[b];
+    }
+
     this->gc = NULL;
 
 }
 /////////////////////////////////////////////////////////////////////////////////////////
+// One series for each node, [node][t], with all of them after each other in one block. 
+// Each column starts on a HERSS_ALIGN byte boundary as the series in a Scenario, so the 
+// Scenarios of the main simulation can use the columns directly, see Scenario::ViewInput(). 
+// The block is kept in column_mem and deleted with the Dataset.
+double **Dataset::NewColumns(double value) {
+    size_t stride = Scenario::SeriesStride(stps, sizeof(double));
+    double **columns;
+    char *mem;
+    try {
+        columns = new double*[nr_nodes];
+        mem     = new char[nr_nodes*stride*sizeof(double) + HERSS_ALIGN];
+    }
+    catch(std::bad_alloc& exc) { 
+        printf("Error: memory allocation failed. \n"); 
+        printf("file: %s  linenr: %d   function: %s \n", __FILE__ , __LINE__, __FUNCTION__);
+        exit(EXIT_FAILURE);
+    }
+    column_mem.push_back(mem);
+
+    double *d = (double *) Scenario::AlignArena(mem);
+    for(size_t n = 0; n < nr_nodes; n++) {
+        columns[n] = d + n*stride;
+        for(size_t t = 0; t < stps; t++) {
+            columns[n][t] = value;
+        }
+    }
+    return columns;
+}
+/////////////////////////////////////////////////////////////////////////////////////////
 void Dataset::readActionsFile() {
 
 	ifstream myfile;
@@ -144,7 +167,7 @@ void Dataset::readActionsFile() {
         keyword = line_obj.extractNextElementFromLine(&line);
         for(size_t c = 0; c < active_nodes; c++) {
             value = line_obj.extractNextElementFromLine(&line);
-            action[t][idnrs[c]]  = stof(value);
+            action[idnrs[c]][t]  = stof(value);
         }
     }
     myfile.close();
@@ -152,11 +175,6 @@ void Dataset::readActionsFile() {
 /////////////////////////////////////////////////////////////////////////////////////////
 void Dataset::readInflowFile() {
 	ifstream myfile;
-	string line;
-    string keyword;
-    string value;
-    Line line_obj;
-    int idnrs[MAX_NR_NODES];  // We save the idnrs given in the first line in the inputfile. 
 
 	myfile.open(gc->inflowfile.c_str() );
 	if (!myfile.is_open()) 	{
@@ -165,36 +183,126 @@ void Dataset::readInflowFile() {
 		exit(EXIT_FAILURE);
 	}
 
-    size_t active_nodes = 0;
+    if(!readInflowSeries(myfile, gc->inflowfile, inflow)) {
+		cout << "There is no inflow series in the file " << gc->inflowfile << " please revisit input\n";
+        printf("file: %s  linenr: %d   function: %s \n", __FILE__ , __LINE__, __FUNCTION__);
+		exit(EXIT_FAILURE);
+    }
+    myfile.close();
 
-    getline(myfile, line);
-    if( line.length()  > 0 && ( line[0] != '#') ) {
-        keyword = line_obj.extractNextElementFromLine(&line);
-        if (!keyword.compare("Date_NodeID") == 0) {
-		    cout << "There is an error in the inflowseries file " << gc->inflowfile << " please revisit input\n";
-            printf("file: %s  linenr: %d   function: %s \n", __FILE__ , __LINE__, __FUNCTION__);
-		    exit(EXIT_FAILURE);
+}
+/////////////////////////////////////////////////////////////////////////////////////////
+// Reads one inflow series into inflow[n][t]. A series has the same format as the inflowfile, a 
+// header line "Date_NodeID idnr idnr .." and then one line for each timestep. 
+// Empty lines and comments in front of the header are skipped. 
+// Returns false if we reach the end of the file before we find a new header. 
+bool Dataset::readInflowSeries(ifstream &myfile, string filename, double **inflow) {
+	string line;
+    string keyword;
+    string value;
+    Line line_obj;
+    int idnrs[MAX_NR_NODES];  // We save the idnrs given in the first line in the inputfile. 
+
+    bool found_header = false;
+    while(getline(myfile, line)) {
+        if( line.length()  > 0 && ( line[0] != '#') ) {
+            found_header = true;
+            break;
         }
-        string tmpline = line;
-        active_nodes = line_obj.calcNrCols(&tmpline);
-        // Now we read in the idnrs for each coloumn and save it. 
-        for(size_t c = 0; c < active_nodes; c++) {
-            value = line_obj.extractNextElementFromLine(&line);
-            idnrs[c] = stoi(value);
+    }
+    if(!found_header) {
+        return false;
+    }
+
+    keyword = line_obj.extractNextElementFromLine(&line);
+    if (!keyword.compare("Date_NodeID") == 0) {
+        cout << "There is an error in the inflowseries file " << filename << " please revisit input\n";
+        printf("file: %s  linenr: %d   function: %s \n", __FILE__ , __LINE__, __FUNCTION__);
+        exit(EXIT_FAILURE);
+    }
+    string tmpline = line;
+    size_t active_nodes = line_obj.calcNrCols(&tmpline);
+    // Now we read in the idnrs for each coloumn and save it. 
+    for(size_t c = 0; c < active_nodes; c++) {
+        value = line_obj.extractNextElementFromLine(&line);
+        idnrs[c] = stoi(value);
+        if(idnrs[c] < 0 || idnrs[c] >= int(nr_nodes)) {
+            cout << "Node idnr " << idnrs[c] << " in the inflowseries file " << filename << " does not exist\n";
+            printf("file: %s  linenr: %d   function: %s \n", __FILE__ , __LINE__, __FUNCTION__);
+            exit(EXIT_FAILURE);
         }
     }
 
     // Now we read in each line with date in the first coloumn and then the data
     for(size_t t = 0; t < this->stps; t++) {
-        getline(myfile, line);
+        if(!getline(myfile, line)) {
+            cout << "The inflowseries file " << filename << " has less than " << stps << " timesteps\n";
+            printf("file: %s  linenr: %d   function: %s \n", __FILE__ , __LINE__, __FUNCTION__);
+            exit(EXIT_FAILURE);
+        }
         keyword = line_obj.extractNextElementFromLine(&line);
         for(size_t c = 0; c < active_nodes; c++) {
             value = line_obj.extractNextElementFromLine(&line);
-            inflow[t][idnrs[c]]  = stof(value);
+            inflow[idnrs[c]][t]  = stof(value);
         }
     }
-    myfile.close();
+    return true;
+}
+/////////////////////////////////////////////////////////////////////////////////////////
+// INFLOW_ENSEMBLE is either one file with several inflow series after each other, 
+// or a directory where each file is one inflow series (sorted by filename). 
+// Each series has the same format as the inflowfile and becomes one member. 
+void Dataset::readInflowEnsemble() {
+
+    vector<string> filenames;
+    if(filesystem::is_directory(gc->ensemblefile)) {
+        for(const auto &entry : filesystem::directory_iterator(gc->ensemblefile)) {
+            string name = entry.path().filename().string();
+            if(entry.is_regular_file() && name[0] != '.') {
+                filenames.push_back(entry.path().string());
+            }
+        }
+        sort(filenames.begin(), filenames.end());
+    } else {
+        filenames.push_back(gc->ensemblefile);
+    }
 
+    vector<double**> members;
+    for(size_t f = 0; f < filenames.size(); f++) {
+        ifstream myfile;
+        myfile.open(filenames[f].c_str() );
+        if (!myfile.is_open()) 	{
+            cout << "The ensemble inflowfile " << filenames[f] << " could not be found/opened. \n";
+            printf("file: %s  linenr: %d   function: %s \n", __FILE__ , __LINE__, __FUNCTION__);
+            exit(EXIT_FAILURE);
+        }
+
+        while(true) {
+            double **series = NewColumns(0.0);
+
+            if(!readInflowSeries(myfile, filenames[f], series)) {
+                delete [] column_mem.back();
+                column_mem.pop_back();
+                delete [] series;
+                break;
+            }
+            members.push_back(series);
+            member_names.push_back(filesystem::path(filenames[f]).filename().string());
+        }
+        myfile.close();
+    }
+
+    if(members.size() < 1) {
+        cout << "Could not find any inflow series in INFLOW_ENSEMBLE " << gc->ensemblefile << "\n";
+        printf("file: %s  linenr: %d   function: %s \n", __FILE__ , __LINE__, __FUNCTION__);
+        exit(EXIT_FAILURE);
+    }
+
+    nr_members = members.size();
+    ensemble_inflow = new double**[nr_members];
+    for(size_t m = 0; m < nr_members; m++) {
+        ensemble_inflow[m] = members[m];
+    }
 }
 /////////////////////////////////////////////////////////////////////////////////////////
 void Dataset::readPricefile() {
@@ -29,6 +29,7 @@ SOFTWARE.
 
 
 #include "herss.h"
+#include <math.h>
 
 GlobalConfig::GlobalConfig(){
     this->globalfile         = STR_NOT_INIT;
@@ -37,6 +38,7 @@ GlobalConfig::GlobalConfig(){
     this->pricefile          = STR_NOT_INIT;
     this->outputfile         = STR_NOT_INIT;
     this->inflowfile         = STR_NOT_INIT;
+    this->ensemblefile       = STR_NOT_INIT;
     this->systemname         = STR_NOT_INIT;
     this->start_statefile    = STR_NOT_INIT;
     this->out_statefile      = STR_NOT_INIT;
@@ -51,10 +53,16 @@ GlobalConfig::GlobalConfig(){
     this->found_start_statefilename    = false;
     this->found_outputfilename         = false;
     this->found_dt                     = false;
+    this->found_ensemblefilename       = false;
     this->write_nodefiles              = false;
 
     this->dt                 = NOT_INIT;
     this->stps               = NOT_INIT;
+    this->nr_threads         = 0;
+    this->checkpoint_interval = 24;
+    this->node_major         = true;
+    this->power_table_points = 0;
+    this->vf_only            = false;
     this->discount_rate      = NOT_INIT;
     this->discount_factor    = NOT_INIT;
     this->nr_nodes           = NOT_INIT;
@@ -125,6 +133,9 @@ void GlobalConfig::SetDirectoriesAndFilenames() {
     topologyfile    = inputdir + topologyfile;
     pricefile       = inputdir + pricefile;
     inflowfile      = inputdir + inflowfile;
+    if(found_ensemblefilename) {
+        ensemblefile = inputdir + ensemblefile;
+    }
     actionsfile     = inputdir + actionsfile;
     start_statefile = inputdir + start_statefile;
     out_statefile   = outputdir + out_statefile;
@@ -271,6 +282,12 @@ void GlobalConfig::readGlobalFile() {
                 this->found_inflowfilename = true;
             }
 
+            // Optional. A file with several inflow series, or a directory with one inflowfile for each member.
+            if (keyword.compare("INFLOW_ENSEMBLE") == 0) {
+                this->ensemblefile = value;
+                this->found_ensemblefilename = true;
+            }
+
             if (keyword.compare("PRICEFILE") == 0) {
                 this->pricefile = value;
                 this->found_pricefilename = true;
@@ -310,6 +327,30 @@ void GlobalConfig::readGlobalFile() {
                 this->write_nodefiles  = stoi(value);
             }
 
+            if (keyword.compare("NR_THREADS") == 0) {
+                this->nr_threads  = stoi(value);
+            }
+
+            if (keyword.compare("NODE_MAJOR") == 0) {
+                this->node_major  = stoi(value);
+            }
+
+            if (keyword.compare("VF_ONLY") == 0) {
+                this->vf_only  = stoi(value);
+            }
+
+            if (keyword.compare("CHECKPOINT_INTERVAL") == 0) {
+                this->checkpoint_interval  = stoi(value);
+            }
+
+            if (keyword.compare("POWER_TABLE_POINTS") == 0) {
+                this->power_table_points  = stoi(value);
+            }
+
+            if (keyword.compare("DISCOUNT_RATE") == 0) {
+                this->discount_rate  = atof(value.c_str());
+            }
+
             if (keyword.compare("OUTPUTDIR") == 0) {
                 this->outputdir = value;
             }
@@ -374,6 +415,9 @@ void GlobalConfig::printGlobalInfo() {
     printf("###########################################################\n");
     printf("ACTIONFILE          %s\n", this->actionsfile.c_str() );
     printf("INFLOWFILE          %s\n", this->inflowfile.c_str() );
+    if(found_ensemblefilename) {
+        printf("INFLOW_ENSEMBLE     %s\n", this->ensemblefile.c_str() );
+    }
     printf("PRICEFILE           %s\n", this->pricefile.c_str() );
     printf("TOPOLOGYFILE        %s\n", this->topologyfile.c_str() );
     printf("OUTPUTFILE          %s\n", this->outputfile.c_str() );
@@ -387,6 +431,16 @@ void GlobalConfig::printGlobalInfo() {
     printf("DT                  %d\n", int(this->dt));
     printf("STPS                %d\n", int(this->stps));
     printf("WRITE_NODEFILES     %d\n", this->write_nodefiles ); 
+    printf("NR_THREADS          %d\n", int(this->nr_threads));
+    printf("CHECKPOINT_INTERVAL %d\n", int(this->checkpoint_interval));
+    printf("NODE_MAJOR          %d\n", int(this->node_major));
+    printf("POWER_TABLE_POINTS  %d\n", int(this->power_table_points));
+    if(this->discount_rate != NOT_INIT) {
+        printf("DISCOUNT_RATE       %.4f\n", this->discount_rate);
+    }
+    if(this->vf_only) {
+        printf("VF_ONLY             %d\n", int(this->vf_only));
+    }
     printf("OUTPUTDIR           %s\n", this->outputdir.c_str() );
 
     printf("n_action_nodes = %lu  [ ", n_action_nodes);
@@ -409,3 +463,23 @@ void GlobalConfig::printGlobalInfo() {
 
 }
 ///////////////////////////////////////////////////////////////////////////////
+// The income and costs in timestep t are discounted from the end of the timestep to the 
+// start of the simulation, and the water left at the end from the end of the last timestep. 
+// Without DISCOUNT_RATE all the factors are exactly 1.0, so the value function is unchanged.
+void GlobalConfig::SetDiscount() {
+
+    double rate = (this->discount_rate == NOT_INIT) ? 0.0 : this->discount_rate;
+    // A negative rate would make discount[t] > 1, and then Herss::UpperBoundVF() is no longer a bound.
+    if(rate < 0.0) {
+        printf("DISCOUNT_RATE must be zero or larger, it is %.4f\n", rate);
+        printf("file: %s  linenr: %d  function: %s \n", __FILE__ , __LINE__, __FUNCTION__);
+        exit(EXIT_FAILURE);
+    }
+
+    this->discount_factor = pow(1.0 + rate, -double(this->dt)/(365.0*24*3600));
+    this->discount.resize(this->stps + 1);
+    for(size_t t = 0; t <= this->stps; t++) {
+        this->discount[t] = pow(this->discount_factor, double(t < this->stps ? t+1 : this->stps));
+    }
+}
+///////////////////////////////////////////////////////////////////////////////
@@ -31,6 +31,11 @@ SOFTWARE.
 #include <random>
 #include <functional>
 #include <limits>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <math.h>
 
 Herss::Herss(){}
 
@@ -51,13 +56,21 @@ Herss::Herss(GlobalConfig *gc){
     this->dt       = gc->dt;
     this->stps     = gc->stps;
     this->nr_nodes = gc->nr_nodes;
+    this->workers    = NULL;
+    this->nr_workers = 0;
+    this->dirty_t         = 0;
+    this->nr_checkpoints  = 0;
+    this->checkpoint_size = 0;
+    this->state_offset    = NULL;
+    this->checkpoints     = NULL;
+    this->checkpoint_interval = 0;
+    this->current_t       = 0;
+    this->node_major_ok   = false;
 
     try {
-        rs     = new Riversystem(gc);
-        scen = new Scenario*[gc->nr_nodes];
-        for(size_t s = 0; s < gc->nr_nodes; s++) {
-            scen[s] = new Scenario(gc->stps, gc->dt, s);
-        }
+        rs    = new Riversystem(gc);
+        state = new SystemState(gc, false);  // The input is in the Dataset, see prepaireSimulation()
+        scen  = state->scen;
     }
     catch(bad_alloc &) {
         cout << "Bad allocation" << std::endl;
@@ -69,34 +82,53 @@ Herss::Herss(GlobalConfig *gc){
 ///////////////////////////////////////////////////////////
 Herss::~Herss(){
     delete rs;
-    for(size_t s=0; s < nr_nodes; s++) {
-        delete scen[s];
+    delete state;
+    for(size_t w = 0; w < nr_workers; w++) {
+        delete workers[w];
+    }
+    delete [] workers;
+    delete [] state_offset;
+    delete [] checkpoints;
+    for(size_t i = 0; i < detour_buf.size(); i++) {
+        delete detour_buf[i];
     }
-    delete [] scen;
 
     this->gc = NULL;
 }
 /////////////////////////////////////////////////////////////////////
 int Herss::prepaireSimulation(Dataset *data) {
 
+    gc->SetDiscount();
+
     for(size_t n = 0; n < gc->nr_nodes; n++) {
         rs->nodes[n]->ReadNodeData(gc->topologyfile);
+        rs->nodes[n]->stps = gc->stps;
+        rs->nodes[n]->dt   = gc->dt;
         rs->nodes[n]->S = this->scen[n];
+        rs->nodes[n]->X = &this->state->ns[n];
         rs->nodes[n]->S->dt   = gc->dt;
         rs->nodes[n]->S->stps = gc->stps;
     }
 
-    // Transfer data to nodes/scenarios
-    for( size_t t = 0; t < stps; ++t ) {
-        for(size_t n = 0; n < gc->nr_nodes; n++) {
-            rs->nodes[n]->S->inflow[t] = data->inflow[t][n];
-            rs->nodes[n]->S->action[t] = data->action[t][n];
-            rs->nodes[n]->S->price[t]  = data->price[t];
-            rs->nodes[n]->S->year[t]   = data->year[t];
-            rs->nodes[n]->S->month[t]  = data->month[t];
-            rs->nodes[n]->S->day[t]    = data->day[t];
-            rs->nodes[n]->S->hour[t]   = data->hour[t];
-        }
+    // The scenarios and the time axis use the series in data, nothing is copied. So data must live 
+    // as long as we simulate, and SetAction, SetInflowInNode and SetPrice change the series in data.
+    timeaxis.stps      = stps;
+    timeaxis.dt        = dt;
+    timeaxis.restprice = data->restprice;
+    timeaxis.price     = data->price;
+    timeaxis.year      = data->year;
+    timeaxis.month     = data->month;
+    timeaxis.day       = data->day;
+    timeaxis.hour      = data->hour;
+    for(size_t n = 0; n < gc->nr_nodes; n++) {
+        rs->nodes[n]->S->ViewInput(data);
+        rs->nodes[n]->timeaxis = &timeaxis;
+    }
+
+    // The Qmin periods only depend on the calendar, so they are looked up once here.
+    for(size_t n = 0; n < gc->nr_nodes; n++) {
+        Node *node = rs->nodes[n];
+        node->qmin.CompileSeries(timeaxis.year, timeaxis.month, timeaxis.day, stps);
     }
 
     // We need to load statefile
@@ -104,6 +136,10 @@ int Herss::prepaireSimulation(Dataset *data) {
         rs->nodes[n]->ReadStateFile(gc->start_statefile);
     }
 
+    for(size_t p = 0; p < gc->nr_pstations; p++) {
+        rs->pstations[p].power_table_points = gc->power_table_points;
+    }
+
     // Initialize all arraycurves 
     for(size_t n = 0; n < gc->nr_nodes; n++) {
         //printf("Init array curves \n");
@@ -111,14 +147,74 @@ int Herss::prepaireSimulation(Dataset *data) {
     }
 
     for(size_t r = 0; r < gc->nr_reservoirs; r++) {
-        rs->reservoirs[r].InitReservoir();
+        rs->reservoirs[r].InitReservoir(rs->reservoirs[r].X);
 
         size_t node_idnr = rs->reservoirs[r].idnr;
         rs->nodes[node_idnr]->reservoir_idnr = r;
 
     }
 
-    // Set pointers for the different outlets (RESERVOIR) and downstream nodes (CHANNEL/POWERSTATION)
+    SetNodePointers();
+    CalcEnergyBounds();
+    FindUnits();
+    AllocateCheckpoints();
+
+    return 0;
+}
+/////////////////////////////////////////////////////////////////////
+// Room for one checkpoint every gc->checkpoint_interval timestep. Must be called after
+// the node data is read, since the size of the state depends on the nodes. 
+void Herss::AllocateCheckpoints() {
+
+    delete [] state_offset;
+    delete [] checkpoints;
+    state_offset = NULL;
+    checkpoints  = NULL;
+    nr_checkpoints = 0;
+    dirty_t        = 0;
+    current_t      = 0;
+    saved_states.clear();
+
+    try {
+        state_offset = new size_t[gc->nr_nodes];
+        checkpoint_size = 0;
+        for(size_t n = 0; n < gc->nr_nodes; n++) {
+            state_offset[n]  = checkpoint_size;
+            checkpoint_size += rs->nodes[n]->StateSize();
+        }
+        checkpoint_interval = gc->checkpoint_interval;
+        if(checkpoint_interval > 0) {
+            size_t max_checkpoints = (stps + checkpoint_interval - 1)/checkpoint_interval;
+            checkpoints = new double[max_checkpoints*checkpoint_size];
+        }
+    }
+    catch(bad_alloc &) {
+        cout << "Bad allocation" << std::endl;
+        printf("file: %s  linenr: %d\n", __FILE__ , __LINE__);
+        exit(EXIT_FAILURE);
+    }
+}
+/////////////////////////////////////////////////////////////////////
+void Herss::SetDirty(size_t t) {
+    if(t < dirty_t) {
+        dirty_t = t;
+    }
+    for(size_t n = 0; n < node_dirty.size(); n++) {
+        node_dirty[n] = true;
+    }
+}
+/////////////////////////////////////////////////////////////////////
+void Herss::SetDirty(size_t t, size_t node_idnr) {
+    if(t < dirty_t) {
+        dirty_t = t;
+    }
+    if(node_idnr < node_dirty.size()) {
+        node_dirty[node_idnr] = true;
+    }
+}
+/////////////////////////////////////////////////////////////////////
+// Set pointers for the different outlets (RESERVOIR) and downstream nodes (CHANNEL/POWERSTATION)
+void Herss::SetNodePointers() {
     for(size_t n = 0; n < gc->nr_nodes; n++) {
         
         if(rs->nodes[n]->downstream_node_in_use) {
@@ -159,7 +255,33 @@ int Herss::prepaireSimulation(Dataset *data) {
         }
     }
 
-    return 0;
+    // Which nodes each node sends water to, and receives water from. 
+    receivers.assign(gc->nr_nodes, vector<size_t>());
+    contributors.assign(gc->nr_nodes, vector<size_t>());
+    tunnel_source.assign(gc->nr_nodes, -1);
+    for(size_t n = 0; n < gc->nr_nodes; n++) {
+        Node *outlets[5] = { rs->nodes[n]->ptr_downstream_node,
+                             rs->nodes[n]->ptr_downstream_node_tunnel,
+                             rs->nodes[n]->ptr_downstream_node_hatch,
+                             rs->nodes[n]->ptr_downstream_node_overflow,
+                             rs->nodes[n]->ptr_downstream_node_auto_qmin };
+        for(size_t o = 0; o < 5; o++) {
+            if(outlets[o] == NULL) {
+                continue;
+            }
+            size_t d = outlets[o]->idnr;
+            if(find(receivers[n].begin(), receivers[n].end(), d) == receivers[n].end()) {
+                receivers[n].push_back(d);
+                contributors[d].push_back(n);
+            }
+        }
+        if(rs->nodes[n]->ptr_downstream_node_tunnel != NULL) {
+            tunnel_source[rs->nodes[n]->ptr_downstream_node_tunnel->idnr] = int(n);
+        }
+    }
+    node_dirty.assign(gc->nr_nodes, true);
+    resimulate.assign(gc->nr_nodes, true);
+    rebuild_up_inflow.assign(gc->nr_nodes, true);
 }
 /////////////////////////////////////////////////////////////////////
 int Herss::WriteStateFile() {
@@ -182,6 +304,7 @@ int Herss::WriteStateFile() {
 void Herss::SetAction(size_t node_idnr, size_t t, double value) {
     // this->scen[idx]->action[t] = value;
     rs->nodes[node_idnr]->S->action[t] = value;
+    SetDirty(t, node_idnr);
 }
 /////////////////////////////////////////////////////////////////////
 double Herss::GetAction(size_t node_idnr, size_t t) {
@@ -219,6 +342,7 @@ void Herss::SetReservoir_Init_fr(size_t node_idnr, double value) {
     //cout << "reservoir_idnr = " << rs->nodes[node_idnr]->reservoir_idnr << endl;
     size_t res_idnr = rs->nodes[node_idnr]->reservoir_idnr;
     rs->reservoirs[res_idnr].reservoir_init_fr = value;
+    SetDirty(0, node_idnr);
 }
 /////////////////////////////////////////////////////////////////////
 void Herss::PrintReservoirLevels_fr() {
@@ -230,8 +354,7 @@ void Herss::PrintReservoirLevels_fr() {
 
     printf("Current Reservoir_fr= ");
     for(size_t r = 0; r < gc->nr_reservoirs; r++) {
-        rs->reservoirs[r].InitReservoir();
-        printf("%.3f ", rs->reservoirs[r].res_fr);
+        printf("%.3f ", rs->reservoirs[r].X->res_fr);
     }
     printf("\n");
 }
@@ -240,7 +363,7 @@ void Herss::PrintRemainingChannelWater_Mm3(){
     if( gc->nr_channels > 0 ) {
         printf("RemainingChannelWater_Mm3= ");
         for(size_t c = 0; c < gc->nr_channels; c++) {
-            printf("%.5f " , rs->channels[c].remaining_available_Mm3);
+            printf("%.5f " , rs->channels[c].X->remaining_available_Mm3);
         }
         printf("\n");
     }
@@ -250,9 +373,7 @@ void Herss::PrintRemainingChannelWater_Mm3(){
 }
 /////////////////////////////////////////////////////////////////////
 double Herss::GetRestPrice() {
-    printf("WORK IN PROGRESS\n");
-    exit(EXIT_FAILURE);
-    return -9;
+    return timeaxis.restprice;
 }
 /////////////////////////////////////////////////////////////////////
 void Herss::PrintInflowSeries(size_t t) {
@@ -270,19 +391,18 @@ void Herss::PrintState() {
 }
 /////////////////////////////////////////////////////////////////////
 void Herss::SetPrice(size_t t, double price, double restprice) {
-    for(size_t n = 0; n < gc->nr_nodes; n++) {
-        rs->nodes[n]->S->price[t] = price;
-        rs->nodes[n]->S->restprice = restprice;
-    }
+    timeaxis.price[t]  = price;
+    timeaxis.restprice = restprice;
+    SetDirty(t);
 }
 /////////////////////////////////////////////////////////////////////
 void Herss::PrintAllInput() {
     printf("Price: ");
     for(size_t t = 0; t < gc->stps; t++) {
-        printf("%.2f ", rs->nodes[0]->S->price[t]);
+        printf("%.2f ", timeaxis.price[t]);
     }
     printf("\n");
-    printf("Restprice = %.2f\n", rs->nodes[0]->S->restprice);
+    printf("Restprice = %.2f\n", timeaxis.restprice);
     printf("Inflow\n");
     for(size_t t = 0; t < gc->stps; t++) {
         for(size_t r = 0; r < gc->nr_reservoirs; r++) {
@@ -306,6 +426,7 @@ void Herss::PrintAllInput() {
 /////////////////////////////////////////////////////////////////////
 void Herss::SetInflowInNode(size_t t, size_t nodenr, double value) {
     rs->nodes[nodenr]->S->inflow[t] = value;
+    SetDirty(t, nodenr);
 }
 
 /////////////////////////////////////////////////////////////////////
@@ -317,7 +438,7 @@ double Herss::GetInflowInNode(size_t t, size_t nodenr) {
 
 /////////////////////////////////////////////////////////////////////
 double Herss::GetPrice(size_t t) {
-    return rs->nodes[0]->S->price[t];
+    return timeaxis.price[t];
 }
 /////////////////////////////////////////////////////////////////////
 // Note that idnr goes from 0 -> n-1
@@ -326,44 +447,705 @@ double Herss::GetReservoir_Init_fr(size_t idnr) {
 }  // Get starting reservoir fraction.
 /////////////////////////////////////////////////////////////////////
 double Herss::GetReservoirLevel_fr(size_t node_idnr, size_t t) { 
+    NeedSeries("GetReservoirLevel_fr");
+    if(rs->nodes[node_idnr]->nodetype != NodeType::RESERVOIR) {
+        printf("ERROR: Node %lu is not a reservoir\n", node_idnr);
+        printf("file: %s  linenr: %d  function: %s \n", __FILE__ , __LINE__, __FUNCTION__);
+        exit(EXIT_FAILURE);
+    }
     return rs->nodes[node_idnr]->S->res_fr[t];
 }
 /////////////////////////////////////////////////////////////////////
 int Herss::Simulate() {
+    return Simulate(-numeric_limits<double>::infinity(), NULL);
+}
+/////////////////////////////////////////////////////////////////////
+// As Simulate(), but we stop as soon as the value function cannot get above incumbent_vf. 
+// Returns 1 if we stopped, and the number of timesteps simulated is stored in t_reached. 
+// The simulation can be continued from there with SimulateRange, or started again with Simulate.
+int Herss::Simulate(double incumbent_vf, size_t *t_reached) {
 
-    //-----------------------------------------------------------------
-    // BVM, July 2024. 
-    // When doing sampling we need to initialize states every time.
-    for(size_t r = 0; r < gc->nr_reservoirs; r++) {
-        rs->reservoirs[r].InitReservoir();
+    size_t K = checkpoint_interval;
+    bool use_bound = (incumbent_vf > -numeric_limits<double>::infinity());
+
+    // With VF_ONLY the output series are rings, so we always start from t=0 without checkpoints.
+    bool ring = (scen[0]->stored < stps);
+    if(ring) {
+        SetDirty(0);
+    }
+
+    // Continue from the last checkpoint before the first timestep with new input.
+    size_t c = 0;
+    if(checkpoints != NULL && nr_checkpoints > 0 && !ring) {
+        c = dirty_t / K;
+        if(c > nr_checkpoints - 1) {
+            c = nr_checkpoints - 1;
+        }
+    }
+    size_t t0 = c*K;
+    if(nr_checkpoints > c + 1) {
+        nr_checkpoints = c + 1;  // The later ones are saved again as we go
+    }
+
+    // Only the nodes depending on the new input are simulated again, the rest keep their results.
+    FindNodesToSimulate();
+
+    for(size_t n = 0; n < gc->nr_nodes; n++) {
+        state->ns[n].upstream_remaining_available_Mm3 = 0.0;
+        if(!resimulate[n]) {
+            continue;
+        }
+        if(t0 == 0) {
+            if(rebuild_up_inflow[n] || ring) {
+                rs->nodes[n]->InitState(&state->ns[n]);
+            } else {
+                // InitState sets up_inflow to zero, but here it comes from nodes we do not simulate.
+                vector<double> up_inflow(scen[n]->up_inflow, scen[n]->up_inflow + stps);
+                rs->nodes[n]->InitState(&state->ns[n]);
+                copy(up_inflow.begin(), up_inflow.end(), scen[n]->up_inflow);
+            }
+        } else {
+            rs->nodes[n]->RestoreState(t0, &state->ns[n], checkpoints + c*checkpoint_size + state_offset[n]);
+            if(rebuild_up_inflow[n]) {
+                for(size_t t = t0; t < stps; t++) {
+                    scen[n]->up_inflow[t] = 0.0;
+                }
+            }
+        }
+    }
+
+    // The sums in the Scenarios must be built again up to t0 for the nodes we simulate again.
+    const double *discount = gc->discount.data();
+    for(size_t n = 0; n < gc->nr_nodes; n++) {
+        if(resimulate[n]) {
+            scen[n]->ResetSums();
+            rs->nodes[n]->AddToSums(0, t0, scen[n], discount);
+        }
+    }
+
+    double profit = 0.0;
+    if(use_bound) {
+        profit = PrepareBound(t0);
+    }
+
+    // Node-major: each unit runs through all timesteps before the next unit starts.
+    bool sweep = gc->node_major && node_major_ok && !use_bound && !ring;
+    if(sweep) {
+        for(size_t u = 0; u < units.size(); u++) {
+            if(!resimulate[units[u][0]]) {
+                continue;
+            }
+            size_t t = t0;
+            while(t < stps) {
+                size_t t1 = stps;
+                if(checkpoints != NULL) {
+                    if(t % K == 0) {
+                        double *cp = checkpoints + (t/K)*checkpoint_size;
+                        for(size_t n : units[u]) {
+                            rs->nodes[n]->SaveState(t, &state->ns[n], cp + state_offset[n]);
+                        }
+                    }
+                    t1 = min(stps, (t/K + 1)*K);
+                }
+                SimulateUnit(u, t, t1, state, false);
+                t = t1;
+            }
+        }
+        if(checkpoints != NULL && t0 < stps) {
+            nr_checkpoints = (stps - 1)/K + 1;
+        }
+    } else {
+        // DO NOT CHANGE THIS AROUND - IT EFFECTS THE RESULTS
+        for( size_t t = t0; t < stps; ++t ) {
+            if(checkpoints != NULL && !ring && t % K == 0) {
+                double *cp = checkpoints + (t/K)*checkpoint_size;
+                for(size_t n = 0; n < gc->nr_nodes; n++) {
+                    if(resimulate[n]) {
+                        rs->nodes[n]->SaveState(t, &state->ns[n], cp + state_offset[n]);
+                    }
+                }
+                nr_checkpoints = t/K + 1;
+            }
+            for(size_t n = 0; n < gc->nr_nodes; n++) {
+                if(resimulate[n]) {
+                    rs->nodes[n]->Simulate(t, state);
+                }
+            }
+
+            // The bound needs the profit so far, so here the economics are done as we go.
+            if(use_bound) {
+                CalcEconomics(t, t+1, state, false);
+            }
+            if(ring) {
+                EndOfStep(t0, t, state, false, !use_bound);
+            }
+            if(use_bound && t+1 < stps) {
+                for(size_t n = 0; n < gc->nr_nodes; n++) {
+                    size_t ts = t & scen[n]->mask;
+                    profit += gc->discount[t] * (scen[n]->income[ts] - scen[n]->cost[ts]);
+                }
+                if(UpperBoundVF(t, profit) < incumbent_vf) {
+                    // The nodes we were simulating must be simulated again the next time.
+                    for(size_t n = 0; n < gc->nr_nodes; n++) {
+                        node_dirty[n] = resimulate[n];
+                    }
+                    current_t = t+1;
+                    if(t_reached != NULL) {
+                        *t_reached = t+1;
+                    }
+                    return 1;
+                }
+            }
+        }
+        if(!use_bound && !ring) {
+            CalcEconomics(t0, stps, state, false);
+        }
+    }
+
+    CalcRemainingWater(state);
+    dirty_t   = stps;
+    current_t = stps;
+    for(size_t n = 0; n < gc->nr_nodes; n++) {
+        node_dirty[n] = false;
+    }
+    if(t_reached != NULL) {
+        *t_reached = stps;
+    }
+    return 0;
+}
+/////////////////////////////////////////////////////////////////////
+// Units for the node-major sweep (NODE_MAJOR). A reservoir and the powerstation at the end 
+// of its tunnel are one unit, since they exchange levels and flow in every timestep. 
+// All other nodes are units of their own, and the units are in the order of the first idnr.
+// The sweep gives the same results as the time loop only if every node gets its water from 
+// units earlier in the sweep, and up_inflow is added up in the same order as in the time loop. 
+// Contributors that would add out of order write to a detour buffer instead, and the buffer 
+// is added when the receiver starts. This is exact only if the contributor writes once to the 
+// receiver in each timestep. If not, node_major_ok is false and we use the time loop.
+void Herss::FindUnits() {
+
+    size_t N = gc->nr_nodes;
+    vector<size_t> rank(N, 0);  // Order in which the nodes run within one timestep of the sweep
+    units.clear();
+    unit_of.assign(N, 0);
+    for(size_t i = 0; i < detour_buf.size(); i++) {
+        delete detour_buf[i];
+    }
+    detour_from.clear();
+    detour_to.clear();
+    detour_buf.clear();
+    node_major_ok = true;
+
+    for(size_t n = 0; n < N; n++) {
+        if(tunnel_source[n] >= 0) {
+            continue;  // Added together with its reservoir
+        }
+        vector<size_t> unit(1, n);
+        if(rs->nodes[n]->ptr_downstream_node_tunnel != NULL) {
+            unit.push_back(rs->nodes[n]->ptr_downstream_node_tunnel->idnr);
+        }
+        for(size_t m : unit) {
+            unit_of[m] = units.size();
+        }
+        units.push_back(unit);
+    }
+    size_t r = 0;
+    for(size_t u = 0; u < units.size(); u++) {
+        for(size_t m : units[u]) {
+            rank[m] = r++;
+        }
+    }
+
+    for(size_t n = 0; n < N; n++) {
+        for(size_t d : receivers[n]) {
+            if(d <= n || unit_of[d] < unit_of[n] || (unit_of[d] == unit_of[n] && tunnel_source[d] != int(n))) {
+                node_major_ok = false;
+            }
+        }
+    }
+
+    for(size_t d = 0; d < N; d++) {
+        // In the time loop the contributors add to up_inflow in the order of idnr. 
+        vector<size_t> &c = contributors[d];
+        size_t in_order = 1;
+        while(in_order < c.size() && rank[c[in_order]] > rank[c[in_order-1]]) {
+            in_order++;
+        }
+        for(size_t i = in_order; i < c.size(); i++) {
+            Node *from = rs->nodes[c[i]];
+            Node *to   = rs->nodes[d];
+            int writes = 0;
+            if(from->nodetype == NodeType::RESERVOIR) {
+                writes = (from->ptr_downstream_node_hatch    == to) + 
+                         (from->ptr_downstream_node_auto_qmin == to) + 
+                         (from->ptr_downstream_node_overflow  == to);
+            } else {
+                writes = (from->ptr_downstream_node == to);
+            }
+            if(writes != 1 || tunnel_source[d] >= 0) {
+                node_major_ok = false;
+                continue;
+            }
+            try {
+                detour_buf.push_back(new Scenario(stps, dt, d, gc->nodetypes[d]));
+            }
+            catch(bad_alloc &) {
+                cout << "Bad allocation" << std::endl;
+                printf("file: %s  linenr: %d\n", __FILE__ , __LINE__);
+                exit(EXIT_FAILURE);
+            }
+            detour_from.push_back(c[i]);
+            detour_to.push_back(d);
+        }
+    }
+
+    if(gc->node_major && !node_major_ok) {
+        printf("NODE_MAJOR cannot give the same results for this riversystem, the time loop is used.\n");
+    }
+}
+/////////////////////////////////////////////////////////////////////
+// Simulates unit u from t0 to t1 (not included). All units before u must be simulated to t1.
+// With all_nodes false, only detours from nodes in resimulate are added. 
+void Herss::SimulateUnit(size_t u, size_t t0, size_t t1, SystemState *Y, bool all_nodes) {
+
+    // Water from the detours to the nodes in this unit, in the order of idnr.
+    for(size_t i = 0; i < detour_to.size(); i++) {
+        if(unit_of[detour_to[i]] == u && (all_nodes || resimulate[detour_from[i]])) {
+            double *up_inflow = Y->scen[detour_to[i]]->up_inflow;
+            double *detour    = detour_buf[i]->up_inflow;
+            for(size_t t = t0; t < t1; t++) {
+                up_inflow[t] += detour[t];
+            }
+        }
+    }
+
+    // Water out of this unit that must wait for the receiver.
+    for(size_t i = 0; i < detour_from.size(); i++) {
+        if(unit_of[detour_from[i]] == u) {
+            for(size_t t = t0; t < t1; t++) {
+                detour_buf[i]->up_inflow[t] = 0.0;
+            }
+            swap(Y->scen[detour_to[i]], detour_buf[i]);
+        }
+    }
+
+    // A unit with one node gets all its input before it is simulated.
+    if(units[u].size() == 1) {
+        rs->nodes[units[u][0]]->SimulateSeries(t0, t1, Y);
+    } else {
+        for( size_t t = t0; t < t1; ++t ) {
+            for(size_t n : units[u]) {
+                rs->nodes[n]->Simulate(t, Y);
+            }
+        }
+    }
+
+    for(size_t i = 0; i < detour_from.size(); i++) {
+        if(unit_of[detour_from[i]] == u) {
+            swap(Y->scen[detour_to[i]], detour_buf[i]);
+        }
+    }
+
+    // The series of the unit are still in the cache.
+    for(size_t n : units[u]) {
+        rs->nodes[n]->CalcEconomics(t0, t1, Y->scen[n]);
+        rs->nodes[n]->AddToSums(t0, t1, Y->scen[n], gc->discount.data());
+    }
+}
+/////////////////////////////////////////////////////////////////////
+// Income and costs for [t0,t1), after the flows and levels are simulated, and the sums in the Scenarios.
+void Herss::CalcEconomics(size_t t0, size_t t1, SystemState *Y, bool all_nodes) {
+    for(size_t n = 0; n < gc->nr_nodes; n++) {
+        if(all_nodes || resimulate[n]) {
+            rs->nodes[n]->CalcEconomics(t0, t1, Y->scen[n]);
+            rs->nodes[n]->AddToSums(t0, t1, Y->scen[n], gc->discount.data());
+        }
+    }
+}
+/////////////////////////////////////////////////////////////////////
+// With VF_ONLY the output series only keep the last HERSS_VF_RING timesteps, so the economics 
+// and the sums are done for each half ring, before the timesteps are written over. 
+// Then up_inflow of the next timestep is set to zero, since the nodes add (+=) to it.
+void Herss::EndOfStep(size_t t0, size_t t, SystemState *Y, bool all_nodes, bool economics) {
+    const size_t half = HERSS_VF_RING/2;
+    if(economics && ((t+1) % half == 0 || t+1 == stps)) {
+        CalcEconomics(max(t0, (t/half)*half), t+1, Y, all_nodes);
+    }
+    if(t+1 < stps) {
+        for(size_t n = 0; n < gc->nr_nodes; n++) {
+            if(all_nodes || resimulate[n]) {
+                Y->scen[n]->up_inflow[(t+1) & Y->scen[n]->mask] = 0.0;
+            }
+        }
+    }
+}
+/////////////////////////////////////////////////////////////////////
+// False (and an error message) if the output series are needed, but only the running sums 
+// are kept (VF_ONLY). The functions using HaveSeries return an error, so a caller (e.g. from 
+// Python) can go on, while the ones using NeedSeries stop.
+bool Herss::HaveSeries(const char *function) const {
+    if(gc->vf_only) {
+        printf("ERROR: %s needs the output series, which are not stored with VF_ONLY\n", function);
+        return false;
+    }
+    return true;
+}
+/////////////////////////////////////////////////////////////////////
+void Herss::NeedSeries(const char *function) const {
+    if(!HaveSeries(function)) {
+        printf("file: %s  linenr: %d  function: %s \n", __FILE__ , __LINE__, __FUNCTION__);
+        exit(EXIT_FAILURE);
+    }
+}
+/////////////////////////////////////////////////////////////////////
+// Upper bound on the value function when timestep t is simulated and profit is the 
+// income minus costs so far. Costs from now on are never negative, so they are left out. 
+// We use the smallest of two bounds: 
+// A: All water we have and will get is used in the best powerstations at the highest price.
+// B: All water is left at the end and valued at restprice, and all powerstations produce 
+//    at full capacity for the rest of the period.
+// With DISCOUNT_RATE the profit so far is discounted as in CalcVF, while the rest is not. 
+// The rate is never negative (see GlobalConfig::SetDiscount), so discount[t] <= 1 and 
+// leaving it out only makes the bound higher.
+double Herss::UpperBoundVF(size_t t, double profit) {
+
+    double water_A = bound_inflow_MWh[t+1];
+    double water_B = bound_inflow_rest_MWh[t+1];
+    for(size_t n = 0; n < gc->nr_nodes; n++) {
+        double water_Mm3 = 0.0;
+        double avail_Mm3 = 0.0;
+        if(rs->nodes[n]->nodetype == NodeType::RESERVOIR) {
+            water_Mm3 = scen[n]->res_Mm3[t & scen[n]->mask];
+            avail_Mm3 = water_Mm3 - rs->reservoirs[rs->nodes[n]->reservoir_idnr].filling_at_lrw_Mm3;
+            if(avail_Mm3 < 0.0) {
+                avail_Mm3 = 0.0;
+            }
+        }
+        if(rs->nodes[n]->nodetype == NodeType::CHANNEL) {
+            water_Mm3 = scen[n]->channel_storage_Mm3[t & scen[n]->mask];
+            avail_Mm3 = water_Mm3;
+        }
+        // Water below LRW can only leave through the outlets, with at most dead_outflow_Mm3 pr timestep.
+        double dead_Mm3 = min(water_Mm3 - avail_Mm3, dead_outflow_Mm3[n] * double(stps - 1 - t));
+        water_A += water_Mm3 * max_energy_MWh_Mm3[n];
+        water_B += avail_Mm3 * rest_MWh_Mm3[n] + dead_Mm3 * dead_rest_MWh_Mm3[n];
+    }
+
+    double bound = bound_price[t+1] * water_A;
+    if(capacity_bound_in_use) {
+        double bound_B = GetRestPrice() * water_B + bound_capacity_Euro[t+1];
+        if(bound_B < bound) {
+            bound = bound_B;
+        }
+    }
+    return profit + bound;
+}
+/////////////////////////////////////////////////////////////////////
+// What one Mm3 of water in each node can be worth later, used by UpperBoundVF. 
+// max_energy_MWh_Mm3: The most energy on its way to the sea. In a powerstation we use the 
+//     largest of the energy equivalent and the turbine efficiency at the highest level in 
+//     the reservoir above. Where the water can go more than one way, we use the best way.
+// rest_MWh_Mm3: The most remaining energy at the end, as in Riversystem::CalcVF.
+// dead_rest_MWh_Mm3: The same for water below LRW, which has to leave the reservoir to count.
+// dead_outflow_Mm3: The most water that can leave a reservoir below LRW in one timestep.
+// max_power_MWh: The most a powerstation can produce in one timestep.
+void Herss::CalcEnergyBounds() {
+
+    size_t N = gc->nr_nodes;
+    max_energy_MWh_Mm3.assign(N, 0.0);
+    rest_MWh_Mm3.assign(N, 0.0);
+    dead_rest_MWh_Mm3.assign(N, 0.0);
+    max_power_MWh.assign(N, 0.0);
+    dead_outflow_Mm3.assign(N, 0.0);
+    capacity_bound_in_use = true;
+
+    // Remaining energy as in CalcVF: the energy equivalents of the powerstations below the node.
+    vector<double> below_MWh_Mm3(N, 0.0);
+
+    // The node idnrs are in calculation order, so all nodes downstream have larger idnrs.
+    for(size_t i = N; i > 0; i--) {
+        size_t n = i-1;
+        Node *node = rs->nodes[n];
+
+        double e = 0.0;
+        if(node->ptr_downstream_node != NULL) {
+            size_t d = node->ptr_downstream_node->idnr;
+            below_MWh_Mm3[n] = below_MWh_Mm3[d];
+            if(rs->nodes[d]->nodetype == NodeType::POWERSTATION) {
+                below_MWh_Mm3[n] += rs->nodes[d]->local_energy_equivalent * 1000.0;  // kWh/m3 -> MWh/Mm3
+            }
+        }
+
+        if(node->nodetype == NodeType::POWERSTATION) {
+            e = node->local_energy_equivalent * 1000.0;
+            // The head is set by the reservoir above the tunnel, whichever node the water came from.
+            if(tunnel_source[n] >= 0) {
+                Powerstation *p = &rs->pstations[node->pstation_idnr];
+                Reservoir *r = &rs->reservoirs[rs->nodes[tunnel_source[n]]->reservoir_idnr];
+                double Hmax = r->ac_res_Mm3_2_masl.ymax - p->powstat_masl;
+                double eff  = (p->ac_turbvirkn_curve.ymax/100.0) * p->static_gen_efficiency;
+                double phys = eff * 1000 * GRAVITY * Hmax / 3600.0;  // MWh/Mm3
+                if(phys > e) {
+                    e = phys;
+                }
+                // Only the tunnel can give water to the powerstation, else we do not know the largest flow.
+                if(contributors[n].size() == 1) {
+                    double Qmax = p->powstat_max_discharge;
+                    if(p->auto_qmin > Qmax) {
+                        Qmax = p->auto_qmin;
+                    }
+                    max_power_MWh[n] = eff * 1000 * GRAVITY * Hmax * Qmax / 1000000.0 * dt / 3600.0;
+                } else {
+                    capacity_bound_in_use = false;
+                }
+            } else {
+                capacity_bound_in_use = false;
+            }
+        }
+
+        double best = 0.0;
+        double best_rest = 0.0;
+        for(size_t r : receivers[n]) {
+            best      = max(best, max_energy_MWh_Mm3[r]);
+            best_rest = max(best_rest, rest_MWh_Mm3[r]);
+        }
+        if(node->nodetype == NodeType::RESERVOIR) {
+            Reservoir *r = &rs->reservoirs[node->reservoir_idnr];
+            double Q = 0.0;  // m3/s
+            if(r->ptr_downstream_node_tunnel != NULL) {
+                Q += max(r->ptr_downstream_node_tunnel->powstat_max_discharge, r->ptr_downstream_node_tunnel->auto_qmin);
+            }
+            if(r->outlet_hatch_in_use) {
+                Q += max(r->minQ_hatch, r->maxQ_hatch);
+            }
+            if(r->outlet_auto_qmin_in_use) {
+                for(int p = 0; p < r->qmin.nr_periods; p++) {
+                    Q += max(r->qmin.timeperiods[p].min_discharge, 0.0);
+                }
+            }
+            dead_outflow_Mm3[n] = MACRO_m3s_2_Mm3(Q, dt);
+        }
+
+        max_energy_MWh_Mm3[n] = e + best;
+        dead_rest_MWh_Mm3[n]  = best_rest;
+        rest_MWh_Mm3[n]       = best_rest;
+        if(node->nodetype == NodeType::RESERVOIR || node->nodetype == NodeType::CHANNEL) {
+            rest_MWh_Mm3[n] = max(best_rest, below_MWh_Mm3[n]);
+        }
+    }
+}
+/////////////////////////////////////////////////////////////////////
+// Set up the series used by UpperBoundVF, when we start at t0:
+// bound_price[t]          The highest price from timestep t, or the restprice at the end.
+// bound_inflow_MWh[t]     The most energy from the inflow from timestep t and out.
+// bound_inflow_rest_MWh[t] The most remaining energy from the inflow from timestep t and out.
+// bound_capacity_Euro[t]  Income with full production from timestep t and out.
+// Returns the profit before t0.
+double Herss::PrepareBound(size_t t0) {
+
+    bound_price.assign(stps + 1, 0.0);
+    bound_inflow_MWh.assign(stps + 1, 0.0);
+    bound_inflow_rest_MWh.assign(stps + 1, 0.0);
+    bound_capacity_Euro.assign(stps + 1, 0.0);
+    bound_price[stps] = GetRestPrice();
+    for(size_t i = stps; i > 0; i--) {
+        size_t t = i-1;
+        double price = bound_price[t+1];
+        double inflow_MWh = 0.0;
+        double inflow_rest_MWh = 0.0;
+        double capacity_Euro = 0.0;
+        for(size_t n = 0; n < gc->nr_nodes; n++) {
+            if(rs->nodes[n]->nodetype == NodeType::POWERSTATION) {
+                price = max(price, timeaxis.price[t]);
+                capacity_Euro += max(timeaxis.price[t], 0.0) * max_power_MWh[n];
+            }
+            inflow_MWh      += MACRO_m3s_2_Mm3(scen[n]->inflow[t], dt) * max_energy_MWh_Mm3[n];
+            inflow_rest_MWh += MACRO_m3s_2_Mm3(scen[n]->inflow[t], dt) * rest_MWh_Mm3[n];
+        }
+        bound_price[t]           = price;
+        bound_inflow_MWh[t]      = bound_inflow_MWh[t+1] + inflow_MWh;
+        bound_inflow_rest_MWh[t] = bound_inflow_rest_MWh[t+1] + inflow_rest_MWh;
+        bound_capacity_Euro[t]   = bound_capacity_Euro[t+1] + capacity_Euro;
+    }
+
+    double profit = 0.0;
+    for(size_t n = 0; n < gc->nr_nodes; n++) {
+        for(size_t t = 0; t < t0; t++) {
+            profit += gc->discount[t] * (scen[n]->income[t] - scen[n]->cost[t]);
+        }
+    }
+    return profit;
+}
+/////////////////////////////////////////////////////////////////////
+// Find the nodes that must be simulated again when the input in the dirty nodes has changed. 
+// - All nodes receiving water from a node we simulate. 
+// - The reservoir with the tunnel to a powerstation we simulate, since it sets the 
+//   reservoir levels in the powerstation and uses the powerstation actions. 
+// - If some of the nodes sending water to a node are simulated, all of them must be, so 
+//   the upstream inflow can be added up again in the same order. 
+// Nodes where no upstream node is simulated keep the upstream inflow from the last run.
+void Herss::FindNodesToSimulate() {
+
+    for(size_t n = 0; n < gc->nr_nodes; n++) {
+        resimulate[n] = node_dirty[n];
+    }
+
+    bool changed = true;
+    while(changed) {
+        changed = false;
+        for(size_t n = 0; n < gc->nr_nodes; n++) {
+            if(!resimulate[n]) {
+                continue;
+            }
+            for(size_t r : receivers[n]) {
+                if(!resimulate[r]) {
+                    resimulate[r] = true;
+                    changed = true;
+                }
+            }
+            if(tunnel_source[n] >= 0 && !resimulate[tunnel_source[n]]) {
+                resimulate[tunnel_source[n]] = true;
+                changed = true;
+            }
+            bool any = false;
+            for(size_t u : contributors[n]) {
+                any = any || resimulate[u];
+            }
+            for(size_t u : contributors[n]) {
+                if(any && !resimulate[u]) {
+                    resimulate[u] = true;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    for(size_t n = 0; n < gc->nr_nodes; n++) {
+        rebuild_up_inflow[n] = false;
+        for(size_t u : contributors[n]) {
+            rebuild_up_inflow[n] = rebuild_up_inflow[n] || resimulate[u];
+        }
+    }
+}
+/////////////////////////////////////////////////////////////////////
+// Store the state of the main simulation at the start of timestep t, i.e. after 
+// Simulate() (t = stps) or SimulateRange(t0, t). Returns a handle for RestoreState, 
+// or NO_HANDLE with VF_ONLY.
+size_t Herss::SaveState(size_t t) {
+    if(!HaveSeries("SaveState")) {
+        return NO_HANDLE;
+    }
+
+    if(t != current_t || state_offset == NULL) {
+        printf("ERROR: Cannot save the state at t=%lu, the simulation is at t=%lu\n", t, current_t);
+        printf("file: %s  linenr: %d  function: %s \n", __FILE__ , __LINE__, __FUNCTION__);
+        exit(EXIT_FAILURE);
+    }
+
+    size_t handle = saved_states.size()/(checkpoint_size + 1);
+    saved_states.resize(saved_states.size() + checkpoint_size + 1);
+    double *buf = saved_states.data() + handle*(checkpoint_size + 1);
+    buf[0] = double(t);
+    for(size_t n = 0; n < gc->nr_nodes; n++) {
+        rs->nodes[n]->SaveState(t, &state->ns[n], buf + 1 + state_offset[n]);
+    }
+    return handle;
+}
+/////////////////////////////////////////////////////////////////////
+// Set the main simulation back to a saved state. The upstream inflow from t and out 
+// is set to zero, since the nodes add (+=) to it while we simulate. 
+// The series before t are not changed, and the running sums are rebuilt from them.
+// Returns -1 with VF_ONLY, else 0.
+int Herss::RestoreState(size_t handle) {
+    if(!HaveSeries("RestoreState")) {
+        return -1;
     }
 
-    for(size_t c = 0; c < gc->nr_channels; c++) {
-        rs->channels[c].SetStartState();
+    if(handle >= saved_states.size()/(checkpoint_size + 1)) {
+        printf("ERROR: There is no saved state with handle=%lu\n", handle);
+        printf("file: %s  linenr: %d  function: %s \n", __FILE__ , __LINE__, __FUNCTION__);
+        exit(EXIT_FAILURE);
     }
 
+    double *buf = saved_states.data() + handle*(checkpoint_size + 1);
+    size_t t = size_t(buf[0]);
     for(size_t n = 0; n < gc->nr_nodes; n++) {
-        rs->nodes[n]->remaining_available_Mm3 = 0.0;
-        rs->nodes[n]->upstream_remaining_available_Mm3 = 0.0;
+        rs->nodes[n]->RestoreState(t, &state->ns[n], buf + 1 + state_offset[n]);
+        for(size_t i = t; i < stps; i++) {
+            scen[n]->up_inflow[i] = 0.0;
+        }
+        state->ns[n].upstream_remaining_available_Mm3 = 0.0;
+        scen[n]->ResetSums();
+        rs->nodes[n]->AddToSums(0, t, scen[n], gc->discount.data());
+    }
+    current_t = t;
+    SetDirty(t > 0 ? t-1 : 0);
+    return 0;
+}
+/////////////////////////////////////////////////////////////////////
+void Herss::ClearSavedStates() {
+    saved_states.clear();
+}
+/////////////////////////////////////////////////////////////////////
+// Simulate timestep t0 to t1-1 in the main simulation. With t0 = 0 we start from the 
+// initial state, else we continue from Simulate/SimulateRange/RestoreState at t0. 
+// When t1 = stps the remaining water is calculated, so CalcVF can be used.
+// Returns -1 with VF_ONLY, where only Simulate() can be used, else 0.
+int Herss::SimulateRange(size_t t0, size_t t1) {
+    if(!HaveSeries("SimulateRange")) {
+        return -1;
+    }
+
+    if(t1 > stps || t0 > t1 || (t0 > 0 && t0 != current_t)) {
+        printf("ERROR: Cannot simulate from t0=%lu to t1=%lu, the simulation is at t=%lu\n", t0, t1, current_t);
+        printf("file: %s  linenr: %d  function: %s \n", __FILE__ , __LINE__, __FUNCTION__);
+        exit(EXIT_FAILURE);
+    }
+
+    if(t0 == 0) {
+        for(size_t n = 0; n < gc->nr_nodes; n++) {
+            rs->nodes[n]->InitState(&state->ns[n]);
+            scen[n]->ResetSums();
+        }
+    } else {
+        for(size_t n = 0; n < gc->nr_nodes; n++) {
+            for(size_t t = t0; t < t1; t++) {
+                scen[n]->up_inflow[t] = 0.0;
+            }
+        }
     }
 
     // DO NOT CHANGE THIS AROUND - IT EFFECTS THE RESULTS
-    for( size_t t = 0; t < stps; ++t ) {
+    for( size_t t = t0; t < t1; ++t ) {
         for(size_t n = 0; n < gc->nr_nodes; n++) {
-            rs->nodes[n]->Simulate(t);
+            rs->nodes[n]->Simulate(t, state);
         }
     }
+    CalcEconomics(t0, t1, state, true);
 
-    // We need to update the remaining water in the node pointers (up, down)
-    // Note that in reservoirs the water below LRW is DEAD.
-    // It needs to be accounted for in the waterbalance calulations, 
-    // but it is not water available for energy production.
-    // Available water and total amount of water in the riversystem is not the same. 
+    if(t1 == stps) {
+        for(size_t n = 0; n < gc->nr_nodes; n++) {
+            state->ns[n].upstream_remaining_available_Mm3 = 0.0;
+        }
+        CalcRemainingWater(state);
+    }
+
+    current_t = t1;
+    SetDirty(t0);
+    return 0;
+}
+/////////////////////////////////////////////////////////////////////
+// We need to update the remaining water in the node pointers (up, down)
+// Note that in reservoirs the water below LRW is DEAD.
+// It needs to be accounted for in the waterbalance calulations, 
+// but it is not water available for energy production.
+// Available water and total amount of water in the riversystem is not the same. 
+int Herss::CalcRemainingWater(SystemState *Y) {
     for(size_t n = 0; n < gc->nr_nodes; n++) {
         if(rs->nodes[n]->ptr_downstream_node != NULL) {
             // We now increase the downstream nodes available water, should have been initialized to zero.
-            rs->nodes[n]->ptr_downstream_node->upstream_remaining_available_Mm3 += 
-                (rs->nodes[n]->remaining_available_Mm3 + rs->nodes[n]->upstream_remaining_available_Mm3);
+            Y->ns[rs->nodes[n]->downstream_idnr].upstream_remaining_available_Mm3 += 
+                (Y->ns[n].remaining_available_Mm3 + Y->ns[n].upstream_remaining_available_Mm3);
                 //    local node water                  +   upstream water 
         }
 
@@ -389,18 +1171,12 @@ int Herss::GlobalWaterBalance(Dataset *data){
         rs->end_water_Mm3 += rs->nodes[n]->GetEndWater_Mm3();
     }
     rs->inflow_volume_Mm3 = 0.0;
-    for(size_t t=0; t < gc->stps; t++) {
-        for(size_t n = 0; n < gc->nr_nodes; n++) {
-            rs->inflow_volume_Mm3 += MACRO_m3s_2_Mm3(data->inflow[t][n] , gc->dt);
-        }
+    for(size_t n = 0; n < gc->nr_nodes; n++) {
+        rs->inflow_volume_Mm3 += scen[n]->sum_local_inflow_Mm3;
     }
     // How much did leave the Riversystem?
     // We need to get the total volume of water leaving the most downstream node.
-    rs->outgoing_Mm3 = 0.0;
-
-    for(size_t t=0; t < gc->stps; t++) {
-        rs->outgoing_Mm3 += MACRO_m3s_2_Mm3(rs->nodes[gc->nr_nodes-1]->S->tot_outflow[t], gc->dt);
-    }
+    rs->outgoing_Mm3 = scen[gc->nr_nodes-1]->sum_outflow_Mm3;
     rs->waterbalance = rs->start_water_Mm3 + rs->inflow_volume_Mm3 - rs->end_water_Mm3 - rs->outgoing_Mm3;
     if(WATERBALANCE_WARNINGS) { 
         printf("-----------------------------------------\n");
@@ -428,21 +1204,340 @@ int Herss::GlobalWaterBalance(Dataset *data){
 }
 /////////////////////////////////////////////////////////////////////
 int Herss::WriteNodeOutput(){
+    NeedSeries("WriteNodeOutput");
     for(size_t n = 0; n < gc->nr_nodes; n++) {
         rs->nodes[n]->WriteNodeOutput(gc);
     }
     return 0;
 }  
 /////////////////////////////////////////////////////////////////////
-int Herss::CalcAdjustmenCosts() {
-    // For each powerstation We loop over all timesteps and check if we break maximum number of adjustemnts pr day.
+// Make sure we have one LaneGroup for each thread used to simulate nr_groups groups of lanes. 
+// The lanes start out with the inflow, actions and price set in this object, since they 
+// might have changed since last time. 
+size_t Herss::PrepareWorkers(size_t nr_groups) {
+
+    size_t nr_threads = gc->nr_threads;
+    if(nr_threads < 1) {
+        nr_threads = thread::hardware_concurrency();
+    }
+    if(nr_threads < 1) {
+        nr_threads = 1;
+    }
+    if(nr_threads > nr_groups) {
+        nr_threads = nr_groups;
+    }
+
+    if(nr_workers < nr_threads) {
+        LaneGroup **tmp = new LaneGroup*[nr_threads];
+        for(size_t w = 0; w < nr_threads; w++) {
+            tmp[w] = (w < nr_workers) ? workers[w] : new LaneGroup(gc, rs);
+        }
+        delete [] workers;
+        workers    = tmp;
+        nr_workers = nr_threads;
+    }
+
+    for(size_t w = 0; w < nr_threads; w++) {
+        workers[w]->SetInput(state);
+    }
+    return nr_threads;
+}
+/////////////////////////////////////////////////////////////////////
+// Evaluate K candidate action schedules and return the value function of each in vf_out[K].
+// The actions are stored as actions[K][stps][n_action_nodes], where the coloumns follow 
+// the order in the actionsfile (gc->actions_idnrs). 
+// The candidates are simulated HERSS_LANES at the time in a LaneGroup, and all threads share 
+// the riversystem. Inflow and price set in this object are used, but the results of the 
+// candidates are not kept here. The last group is filled up with copies of the last candidate.
+int Herss::SimulateBatch(size_t K, double *actions, double *vf_out) {
+
+    size_t nr_groups  = (K + HERSS_LANES - 1)/HERSS_LANES;
+    size_t nr_threads = PrepareWorkers(nr_groups);
+
+    size_t n_actions = gc->n_action_nodes;
+    double restprice = GetRestPrice();
+    atomic<size_t> next_group(0);
+
+    auto evaluate = [&](LaneGroup *G) {
+        size_t g;
+        double vf[HERSS_LANES];
+        while((g = next_group++) < nr_groups) {
+            for(size_t l = 0; l < HERSS_LANES; l++) {
+                size_t k = g*HERSS_LANES + l;
+                if(k >= K) {
+                    k = K-1;
+                }
+                double *candidate = actions + k*stps*n_actions;
+                for(size_t t = 0; t < stps; t++) {
+                    for(size_t a = 0; a < n_actions; a++) {
+                        G->SetAction(l, gc->actions_idnrs[a], t, candidate[t*n_actions + a]);
+                    }
+                }
+            }
+            G->Simulate();
+            G->CalcVF(restprice, vf);
+            for(size_t l = 0; l < HERSS_LANES && g*HERSS_LANES + l < K; l++) {
+                vf_out[g*HERSS_LANES + l] = vf[l];
+            }
+        }
+    };
+
+    vector<thread> pool;
+    for(size_t w = 0; w < nr_threads; w++) {
+        pool.push_back(thread(evaluate, workers[w]));
+    }
+    for(size_t w = 0; w < nr_threads; w++) {
+        pool[w].join();
+    }
+    return 0;
+}
+/////////////////////////////////////////////////////////////////////
+// The price only enters the simulation through the income in the powerstations, 
+// flows, levels and Power does not depend on it. After Simulate() we can therefore 
+// change the price and recalculate income, profit and value function without running 
+// the riversystem again. Costs (start/stop, qmin, lrw and adjustments) are kept. 
+// Gives the same VF as Simulate() + CalcVF() with the same price. 
+double Herss::Reprice(double *price, double restprice) {
+    NeedSeries("Reprice");
+    for(size_t t = 0; t < stps; t++) {
+        SetPrice(t, price[t], restprice);
+    }
     for(size_t n = 0; n < gc->nr_nodes; n++) {
         if(rs->nodes[n]->nodetype == NodeType::POWERSTATION) { 
-            if(rs->nodes[n]->max_adjustment_pr_day > 0 ) {
-                rs->adjust_cost = rs->pstations[rs->nodes[n]->pstation_idnr].CalcAdjustmenCosts();
+            Scenario *S = scen[n];
+            for(size_t t = 0; t < stps; t++) {
+                S->income[t] = S->Power[t] * timeaxis.price[t];
+                S->profit[t] = S->income[t] - S->cost[t];
             }
+            S->ResetSums();
+            rs->nodes[n]->AddToSums(0, stps, S, gc->discount.data());
         }
     }
+    return rs->CalcVF(restprice);
+}
+/////////////////////////////////////////////////////////////////////
+// Value function of the last Simulate() for K price series, prices[K][stps]. 
+// The production of all powerstations is summed once, and then each price series 
+// is only a dot product. The state in this object is not changed. 
+// Since the income is summed in another order than in CalcVF the result can differ 
+// from Reprice() in the last digits. 
+int Herss::RepriceBatch(size_t K, double *prices, double *restprices, double *vf_out) {
+    if(!HaveSeries("RepriceBatch")) {
+        return -1;
+    }
+
+    double *tot_power;
+    try {
+        tot_power = new double[stps];
+    }
+    catch(bad_alloc &) {
+        cout << "Bad allocation" << std::endl;
+        printf("file: %s  linenr: %d\n", __FILE__ , __LINE__);
+        exit(EXIT_FAILURE);
+    }
+
+    const double *discount = gc->discount.data();
+    double remaining_MWh = 0.0;
+    double cost          = 0.0;
+    for(size_t t = 0; t < stps; t++) {
+        tot_power[t] = 0.0;
+    }
+    for(size_t n = 0; n < gc->nr_nodes; n++) {
+        if(rs->nodes[n]->nodetype == NodeType::POWERSTATION) { 
+            remaining_MWh += (rs->nodes[n]->local_energy_equivalent * state->ns[n].upstream_remaining_available_Mm3 * 1000000.0 / 1000.0); // MWh
+            for(size_t t = 0; t < stps; t++) {
+                tot_power[t] += scen[n]->Power[t];
+            }
+        }
+        for(size_t t = 0; t < stps; t++) {
+            cost += discount[t] * scen[n]->cost[t];
+        }
+    }
+    for(size_t t = 0; t < stps; t++) {
+        tot_power[t] *= discount[t];  // Present value of the production
+    }
+
+    // HERSS_LANES partial sums so the compiler can vectorize the dot product.
+    for(size_t k = 0; k < K; k++) {
+        double *price = prices + k*stps;
+        double part[HERSS_LANES];
+        for(size_t l = 0; l < HERSS_LANES; l++) {
+            part[l] = 0.0;
+        }
+        size_t t = 0;
+        for( ; t + HERSS_LANES <= stps; t += HERSS_LANES) {
+            for(size_t l = 0; l < HERSS_LANES; l++) {
+                part[l] += tot_power[t+l] * price[t+l];
+            }
+        }
+        for( ; t < stps; t++) {
+            part[0] += tot_power[t] * price[t];
+        }
+        double income = 0.0;
+        for(size_t l = 0; l < HERSS_LANES; l++) {
+            income += part[l];
+        }
+        vf_out[k] = (income - cost) + remaining_MWh*restprices[k]*discount[stps];
+    }
+
+    delete [] tot_power;
+    return 0;
+}
+/////////////////////////////////////////////////////////////////////
+// Simulate every inflow series in INFLOW_ENSEMBLE with the actions, price and start state 
+// set in this object. Only the inflow differs between the members, so the input is 
+// prepared once and the members are simulated HERSS_LANES at the time. 
+// The results are stored in this->ensemble. 
+int Herss::SimulateEnsemble(Dataset *data) {
+
+    size_t K = data->nr_members;
+    if(K < 1) {
+        printf("ERROR: There are no ensemble members, please set INFLOW_ENSEMBLE in the global file\n");
+        printf("file: %s  linenr: %d  function: %s \n", __FILE__ , __LINE__, __FUNCTION__);
+        exit(EXIT_FAILURE);
+    }
+
+    ensemble.resize(K);
+
+    double start_water_Mm3 = 0.0;
+    for(size_t n = 0; n < gc->nr_nodes; n++) {
+        start_water_Mm3 += rs->nodes[n]->GetStartWater_Mm3();
+    }
+
+    size_t nr_groups  = (K + HERSS_LANES - 1)/HERSS_LANES;
+    size_t nr_threads = PrepareWorkers(nr_groups);
+    double restprice  = GetRestPrice();
+    atomic<size_t> next_group(0);
+
+    auto evaluate = [&](LaneGroup *G) {
+        size_t g;
+        double vf[HERSS_LANES];
+        double end_water_Mm3[HERSS_LANES];
+        while((g = next_group++) < nr_groups) {
+            for(size_t l = 0; l < HERSS_LANES; l++) {
+                size_t m = g*HERSS_LANES + l;
+                if(m >= K) {
+                    m = K-1;
+                }
+                for(size_t n = 0; n < gc->nr_nodes; n++) {
+                    for(size_t t = 0; t < stps; t++) {
+                        G->SetInflow(l, n, t, data->ensemble_inflow[m][n][t]);
+                    }
+                }
+            }
+            G->Simulate();
+            G->CalcVF(restprice, vf);
+            G->GetEndWater_Mm3(end_water_Mm3);
+
+            for(size_t l = 0; l < HERSS_LANES && g*HERSS_LANES + l < K; l++) {
+                size_t m = g*HERSS_LANES + l;
+                EnsembleMember *em = &ensemble[m];
+                em->name = data->member_names[m];
+                em->vf   = vf[l];
+                em->inflow_Mm3 = 0.0;
+                for(size_t t = 0; t < stps; t++) {
+                    for(size_t n = 0; n < gc->nr_nodes; n++) {
+                        em->inflow_Mm3 += MACRO_m3s_2_Mm3(data->ensemble_inflow[m][n][t] , gc->dt);
+                    }
+                }
+                em->outflow_Mm3   = G->ls[gc->nr_nodes-1].sum_outflow_Mm3[l];
+                em->end_water_Mm3 = end_water_Mm3[l];
+                em->waterbalance  = start_water_Mm3 + em->inflow_Mm3 - em->end_water_Mm3 - em->outflow_Mm3;
+            }
+        }
+    };
+
+    vector<thread> pool;
+    for(size_t w = 0; w < nr_threads; w++) {
+        pool.push_back(thread(evaluate, workers[w]));
+    }
+    for(size_t w = 0; w < nr_threads; w++) {
+        pool[w].join();
+    }
+
+    for(size_t m = 0; m < K; m++) {
+        if(abs(ensemble[m].waterbalance) > 0.0001) {
+            printf("-----------------------------------------\n");
+            printf( "ENSEMBLE WATERBALANCE ERROR \n");
+            printf("member            = %lu %s\n", m, ensemble[m].name.c_str() );
+            printf("start_water_Mm3   = %.6f\n", start_water_Mm3 );
+            printf("inflow_volume_Mm3 = %.6f\n", ensemble[m].inflow_Mm3); 
+            printf("outflow_Mm3       = %.6f\n", ensemble[m].outflow_Mm3);
+            printf("remaining_Mm3     = %.6f\n", ensemble[m].end_water_Mm3);
+            printf("waterbalance      = %.6f\n", ensemble[m].waterbalance);
+            printf("file: %s  linenr: %d  function: %s \n", __FILE__ , __LINE__, __FUNCTION__);
+            exit(EXIT_FAILURE);
+        }
+    }
+    return 0;
+}
+/////////////////////////////////////////////////////////////////////
+// Write the value function and waterbalance of each member, and a summary of the ensemble. 
+int Herss::WriteEnsembleOutput() {
+
+    size_t K = ensemble.size();
+    if(K < 1) {
+        return 0;
+    }
+
+    vector<double> sorted_vf(K);
+    double mean_vf = 0.0;
+    double max_waterbalance = 0.0;
+    for(size_t m = 0; m < K; m++) {
+        sorted_vf[m] = ensemble[m].vf;
+        mean_vf += ensemble[m].vf;
+        if(abs(ensemble[m].waterbalance) > max_waterbalance) {
+            max_waterbalance = abs(ensemble[m].waterbalance);
+        }
+    }
+    mean_vf = mean_vf/double(K);
+    sort(sorted_vf.begin(), sorted_vf.end());
+
+    double std_vf = 0.0;
+    for(size_t m = 0; m < K; m++) {
+        std_vf += (ensemble[m].vf - mean_vf)*(ensemble[m].vf - mean_vf);
+    }
+    std_vf = (K > 1) ? sqrt(std_vf/double(K-1)) : 0.0;
+
+    // Percentiles with linear interpolation between the sorted members.
+    auto percentile = [&](double p) {
+        double pos = p*double(K-1);
+        size_t lower = size_t(pos);
+        size_t upper = (lower+1 < K) ? lower+1 : lower;
+        return sorted_vf[lower] + (pos - double(lower))*(sorted_vf[upper] - sorted_vf[lower]);
+    };
+
+    FILE *fp;
+    char outfilename [100];
+    sprintf (outfilename, "%sensemble_%s_output.txt",  gc->outputdir.c_str(),  gc->systemname.c_str() );
+
+    if((fp = fopen(  outfilename ,"w"))==NULL) {
+        printf("Cannot open file %s \n", outfilename);
+        printf("file: %s  linenr: %d  function: %s \n", __FILE__ , __LINE__, __FUNCTION__);
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(fp, "Ensemble %s\n", gc->systemname.c_str() );
+    fprintf(fp, "Member Name                 [Euro]           [Mm3]       [Mm3]       [Mm3]       [Mm3]\n");
+    fprintf(fp, "Member Name                 ValueFunction    Inflow      Outflow     End_water   Waterbalance\n");
+    for(size_t m = 0; m < K; m++) {
+        fprintf(fp, "%6lu %-20s %16.5f %11.4f %11.4f %11.4f %11.6f\n", m, ensemble[m].name.c_str(), ensemble[m].vf,
+            ensemble[m].inflow_Mm3, ensemble[m].outflow_Mm3, ensemble[m].end_water_Mm3, ensemble[m].waterbalance);
+    }
+    fprintf(fp,"-------------------------------------------\n");
+    fprintf(fp, "nr_members                   = %lu\n", K);
+    fprintf(fp, "mean_valuefunction_Euro      = %.3f\n", mean_vf);
+    fprintf(fp, "std_valuefunction_Euro       = %.3f\n", std_vf);
+    fprintf(fp, "min_valuefunction_Euro       = %.3f\n", sorted_vf[0]);
+    fprintf(fp, "p10_valuefunction_Euro       = %.3f\n", percentile(0.10));
+    fprintf(fp, "p50_valuefunction_Euro       = %.3f\n", percentile(0.50));
+    fprintf(fp, "p90_valuefunction_Euro       = %.3f\n", percentile(0.90));
+    fprintf(fp, "max_valuefunction_Euro       = %.3f\n", sorted_vf[K-1]);
+    fprintf(fp, "max_abs_waterbalance_Mm3     = %.6f\n", max_waterbalance);
+    fclose(fp);
+
+    printf("Ensemble members = %lu  mean ValueFunction = %.5f  std = %.5f  min = %.5f  max = %.5f\n", 
+        K, mean_vf, std_vf, sorted_vf[0], sorted_vf[K-1]);
     return 0;
 }
 /////////////////////////////////////////////////////////////////////
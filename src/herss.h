@@ -38,6 +38,7 @@ SOFTWARE.
 #include <string.h>
 #include <sstream>
 #include <map>
+#include <vector>
 #include "arraycurve.h"
 #include <time.h>
 
@@ -80,6 +81,26 @@ const string NUMERIC = "0123456789.-";
 // Turn on and off warnings related to check of economy in the system
 #define ECONOMY_WARNINGS false
 
+// Number of scenarios simulated together in a LaneGroup. 
+// 4 fills one AVX2 register with doubles, 8 fills one AVX-512 register.
+#define HERSS_LANES 8
+
+// Alignment in bytes of the series in a Scenario. One cache line and one AVX-512 register.
+#define HERSS_ALIGN 64
+
+// Timesteps kept of the output series with VF_ONLY, a power of two. The economics are 
+// done for half of them at the time, so the timestep before is always there.
+#define HERSS_VF_RING 64
+
+// Number of series in a Scenario, see Scenario::ArenaSize(). All nodes have the input 
+// series and the base output series, and each node type has its own in addition.
+// The price and the calendar are the same for all nodes, and are found in TimeAxis.
+#define SCENARIO_INPUT_SERIES 2
+#define SCENARIO_BASE_SERIES 4
+#define SCENARIO_RESERVOIR_SERIES 9
+#define SCENARIO_POWERSTATION_SERIES 6
+#define SCENARIO_CHANNEL_SERIES 2
+
 
 /////////////////////////////////////////////////////////////////
 #define MACRO_m3s_2_Mm3(q, dt) q*dt/1000000.0
@@ -121,7 +142,11 @@ inline const char* EnumToString(NodeType v)
 class Scenario;
 class GlobalConfig;
 class Channel;
+class NodeState;
 class SystemState;
+class LaneState;
+class LaneGroup;
+class Riversystem;
 //-----------------------------------------------------------------------
 
 // Simple time class
@@ -184,6 +209,7 @@ public:
     string pricefile;
     string outputfile;
     string inflowfile;
+    string ensemblefile;     // INFLOW_ENSEMBLE, optional
     string systemname;
     string start_statefile;  // Reservoir levels and water storage in channels (how to value the water in channels?).
     string out_statefile;
@@ -198,6 +224,7 @@ public:
     bool found_start_statefilename;  
     bool found_outputfilename;
     bool found_dt;
+    bool found_ensemblefilename;
     bool write_nodefiles;
 
     size_t nr_nodes;
@@ -206,9 +233,18 @@ public:
     size_t nr_channels;
     size_t dt;     // Delta time step in seconds
     size_t stps;   // Nr of time steps in the simulation
-
-    double discount_rate;  // DISCOUNT_RATE 0.05
-    double discount_factor;
+    size_t nr_threads;  // NR_THREADS, worker threads used in batch evaluation. 0 means all cores.
+    bool node_major;    // NODE_MAJOR, simulate one unit at the time through all timesteps (default 1).
+    size_t checkpoint_interval;  // CHECKPOINT_INTERVAL, timesteps between the checkpoints in Herss::Simulate(). 0 means none.
+    size_t power_table_points;   // POWER_TABLE_POINTS, discharges in the power table of each powerstation. 0 means exact calculation.
+    // VF_ONLY, store only the input series and the sums needed by the value function (default 0). 
+    // Then Herss::SaveState returns NO_HANDLE, and RestoreState, SimulateRange and RepriceBatch return -1. 
+    // Reprice, GetReservoirLevel_fr and the output files with series stop the program.
+    bool vf_only;
+
+    double discount_rate;  // DISCOUNT_RATE 0.05, yearly rate, zero or larger. Not set means no discounting.
+    double discount_factor;  // Discount factor for one timestep
+    vector<double> discount;  // Present value factor of the income and costs in timestep t, and discount[stps] for the end water
 
     size_t actions_idnrs[MAX_NR_NODES];  // We save the idnrs pointing to nodes with actions (actions inputfile). 
     size_t n_action_nodes;  // Number of nodes were we need to set actions. Could be at PSTATION or RESERVOIRS (hatch_release) 
@@ -221,6 +257,7 @@ public:
     void printGlobalInfo();
     void Diagnose();
     void checkNrSteps();  // Checks number of timesteps in the pricefile
+    void SetDiscount();   // Fills discount, must be called when dt and stps are known
 };
 ///////////////////////////////////////////////////////////////////////////////////////////
 class Dataset {
@@ -233,8 +270,9 @@ public:
 
     double *price;          // We assume all nodes located in same price area. So we need only one price series. 
     double restprice;
-    double **inflow;        // One series for each node. We can point to these series from othe robjects.
-    double **action;     // One series for each node. Could change in the future. 
+    double **inflow;        // [node][t] One series for each node. The Scenarios of the main simulation point to these series.
+    double **action;     // [node][t] One series for each node. Could change in the future. 
+    vector<char*> column_mem;  // The blocks with the columns of inflow, action and ensemble_inflow, see NewColumns()
     int *year;
     int *month;
     int *day;
@@ -244,23 +282,64 @@ public:
     string str_startdate;                            // Startdate of data
     string str_enddate;                              // End date of data
 
+    size_t nr_members;                // Number of inflow series in INFLOW_ENSEMBLE, zero if not used.
+    double ***ensemble_inflow;        // [member][node][t]
+    vector<string> member_names;      // Filename each member was read from. 
+
+    double **NewColumns(double value);  // One series for each node in one aligned block
     void readPricefile();
     void readInflowFile();
     void readActionsFile();
+    void readInflowEnsemble();
+    bool readInflowSeries(ifstream &myfile, string filename, double **inflow);
 
 };
 ///////////////////////////////////////////////////////////////////////////////////////////
+// The time axis of the riversystem: calendar, price, restprice and dt. It is the same for all 
+// nodes and all SystemStates, so there is only one, in Herss, and the nodes read it through 
+// Node::timeaxis. The series are the ones in the Dataset, see Herss::prepaireSimulation().
+class TimeAxis {
+public:
+    TimeAxis() {
+        stps = 0;
+        dt   = 0;
+        restprice = NOT_INIT;
+        price = NULL;
+        year  = NULL;
+        month = NULL;
+        day   = NULL;
+        hour  = NULL;
+    };
+    ~TimeAxis(){};
+    size_t stps;
+    size_t dt;
+    double restprice;
+    double *price;  // [stps] Euro/MWh
+    int *year;
+    int *month;
+    int *day;
+    int *hour;
+};
+///////////////////////////////////////////////////////////////////////////////////////////
 class Scenario {
 
 public:
 	Scenario();
-    Scenario(size_t stps, size_t dt, size_t idnr);
+    Scenario(size_t stps, size_t dt, size_t idnr, NodeType nodetype, bool vf_only = false, bool own_input = true, char *arena = NULL);
     ~Scenario();
+    static size_t SeriesStride(size_t stps, size_t size);  // Elements between the series, a multiple of HERSS_ALIGN bytes
+    static size_t NrOutputSeries(NodeType nodetype);        // Number of output series for this node type
+    static size_t ArenaSize(size_t stps, NodeType nodetype, bool vf_only, bool own_input);  // Bytes needed for all the series
+    static char *AlignArena(char *mem);                     // First HERSS_ALIGN byte boundary in mem
+    void ViewInput(Dataset *data);  // The inflow and actions are the ones in data, not copies
+    char *arena_mem;  // Allocated here if no arena was given, else NULL
+    char *arena;      // All the series, one after the other from an aligned start
 
     size_t stps;
     size_t dt;
     size_t idnr;  // This is the same idnr as used in node.
-    double restprice;
+    size_t stored;  // Timesteps kept in the output series, stps or HERSS_VF_RING with VF_ONLY
+    size_t mask;    // Timestep t of an output series is found at [t & mask]
     bool broken_lrw; 
     bool broken_qmin;
 
@@ -279,43 +358,146 @@ public:
     double sum_total_energy_MWh;
     double sum_overflow_Mm3;  // We check overflow over the optimization horizon.
 
-    // Arrays
-    double *price;
+    // Sums over the timesteps simulated so far, added by Node::AddToSums() as the simulation goes, 
+    // so the value function and the water balance do not have to go through the series again. 
+    // sum_income_Euro, sum_cost_Euro, sum_prod_MWh and sum_local_inflow_Mm3 are also kept this way.
+    double pv_income_Euro;        // Present value of the income, see GlobalConfig::SetDiscount()
+    double pv_cost_Euro;          // Present value of the costs
+    double sum_adjust_cost_Euro;  // The part of sum_cost_Euro from Powerstation::AdjustmentCost
+    double sum_inflow_Mm3;        // Local and upstream inflow
+    double sum_outflow_Mm3;
+    void ResetSums();
+
+    // Arrays, all of them in arena or in the Dataset (ViewInput). The series a node type does not use are NULL.
+    // The input series (action and inflow) always have stps values, the output series only 
+    // keep the last HERSS_VF_RING timesteps with VF_ONLY. 
+    // All nodes
     double *action;
-    double *q_action;
     double *inflow;
-    double *tot_outflow;
-    double *tot_inflow;
-    double *local_inflow;
     double *up_inflow;
-    double *tunnelflow_m3s;
-    double *hatchflow_m3s;
-    double *overflow_m3s;
-    double *auto_qmin_m3s;
-    double *channel_storage_Mm3;
+    double *tot_outflow;
+    double *income;
+    double *cost;
 
+    // Reservoir
+    double *tot_inflow;
     double *res_Mm3;        // Reservoir filling in Mm3
     double *res_masl;       // Reservoir filling in meters above sea level (masl)
     double *res_fr;         // Reservoir filling as a fraction of full
-    double *profit;
     double *overflow_Mm3;
-    double *income;
-    double *cost;
-    double *cost_qmin;
-    double *startStopCost;
-    double *cost_lrw;
-    double *cost_fake_lrw;
-    double *adjust_cost;
+    double *tunnelflow_m3s;
+    double *hatchflow_m3s;
+    double *overflow_m3s;
+    double *auto_qmin_m3s;  // Also Powerstation
 
+    // Powerstation
+    double *profit;
     double *Hbrutto;  // Hydraulic head brutto
     double *Hnetto;  // Hydraulic head netto
     double *Power;
-    int *year;
-    int *month;
-    int *day;
-    int *hour;
-    int *qmin_flag;
+    double *adjust_cost;
+
+    // Channel
+    double *cost_qmin;
+    double *channel_storage_Mm3;
+
+};
+//////////////////////////////////////////////////////////////////////////////////////////
+// Dynamic state of one node during a simulation. 
+// Everything that changes while we simulate is kept here or in the Scenario, while the 
+// Node objects (curves, parameters and outlets) are left untouched. This way the same 
+// Riversystem can be used by several simulations at the same time.
+class NodeState {
+public:
+    NodeState();
+    ~NodeState();
+    Scenario *S;
+    double res_Mm3;             // Reservoir filling [Mm3]
+    double res_masl;            // Reservoir filling [masl]
+    double res_fr;              // Reservoir filling as a fraction of full.
+    double up_res_Mm3;          // Upstream reservoir volume - used in Powerstation. 
+    double start_of_stp_masl;   // Upstream reservoir level, set by the reservoir connected to a Powerstation.
+    double end_of_stp_masl;
+    double remaining_available_Mm3;
+    double upstream_remaining_available_Mm3; // We accumulate as we go downward. 
+    double waterflow_m3[MAX_TRAVELTIME_HOURS];  // Water stored in each part of a channel, ring buffer starting at channel_head. [m3]
+    size_t channel_head;        // Index of the first part of the channel in waterflow_m3.
+    double channel_storage_m3;  // Sum of waterflow_m3. [m3]
+    int nr_adjustments;         // Changes in production so far this day, used by Powerstation.
+};
+//////////////////////////////////////////////////////////////////////////////////////////
+// The complete state of one simulation, one NodeState and one Scenario pr node.
+class SystemState {
+public:
+    SystemState(GlobalConfig *gc, bool own_input = true);  // See Scenario::ViewInput() for own_input false
+    ~SystemState();
+    size_t nr_nodes;
+    size_t stps;
+    NodeState *ns;
+    Scenario **scen;
+    char *arena_mem;  // The series of all the Scenarios, see Scenario::ArenaSize()
+    void CopyInput(SystemState *src);  // Copy inflow and action from src. Needs own_input.
+};
+//////////////////////////////////////////////////////////////////////////////////////////
+// State of one node in a LaneGroup. Every variable has one value for each lane (scenario),
+// and the series are stored scenario-minor, i.e. series[t*HERSS_LANES + lane].
+class LaneState {
+public:
+    LaneState();
+    ~LaneState();
+    double res_Mm3[HERSS_LANES];
+    double res_masl[HERSS_LANES];
+    double up_res_Mm3[HERSS_LANES];
+    double start_of_stp_masl[HERSS_LANES];
+    double end_of_stp_masl[HERSS_LANES];
+    double remaining_available_Mm3[HERSS_LANES];
+    double upstream_remaining_available_Mm3[HERSS_LANES];
+    double up_inflow[HERSS_LANES];     // Upstream inflow in the current timestep [m3/s]
+    double prev_power[HERSS_LANES];    // Power in the previous timestep [MWh]
+    int nr_adjustments[HERSS_LANES];   // Changes in production so far this day
+    double sum_outflow_Mm3[HERSS_LANES];  // Total outflow from the node so far [Mm3]
+    double waterflow_m3[MAX_TRAVELTIME_HOURS][HERSS_LANES];  // Ring buffer as in NodeState
+    size_t channel_head;                       // The same for all lanes
+    double channel_storage_m3[HERSS_LANES];
+    double *inflow;   // [stps][HERSS_LANES]
+    double *action;   // [stps][HERSS_LANES]
+    double *income;   // [stps][HERSS_LANES]
+    double *cost;     // [stps][HERSS_LANES]
+};
+//////////////////////////////////////////////////////////////////////////////////////////
+// Simulates HERSS_LANES scenarios of the same riversystem in lock-step. 
+// The lanes have their own inflow and actions, while price and calendar are taken from Node::timeaxis. 
+// All loops over lanes have a fixed length and few branches, so the compiler can vectorize them,
+// and every lane gives exactly the same result as a scalar simulation of that scenario.
+class LaneGroup {
+public:
+    LaneGroup(GlobalConfig *gc, Riversystem *rs);
+    ~LaneGroup();
+    size_t nr_nodes;
+    size_t stps;
+    Riversystem *rs;
+    SystemState *base;   // The inflow and actions the lanes started out with.
+    LaneState *ls;       // One for each node.
 
+    void SetInput(SystemState *src);  // Use src as base and copy its inflow and actions to all lanes.
+    void SetAction(size_t lane, size_t node_idnr, size_t t, double value);
+    void SetInflow(size_t lane, size_t node_idnr, size_t t, double value);
+    int Simulate();
+    void CalcVF(double restprice, double *vf);  // vf[HERSS_LANES]
+    void GetEndWater_Mm3(double *water);        // Water in all nodes at the end, water[HERSS_LANES]
+};
+//////////////////////////////////////////////////////////////////////////////////////////
+// Results for one inflow series in INFLOW_ENSEMBLE.
+class EnsembleMember {
+public:
+    EnsembleMember(){};
+    ~EnsembleMember(){};
+    string name;             // Filename the inflow series was read from.
+    double vf;               // Value function [Euro]
+    double inflow_Mm3;       // Local inflow to all nodes
+    double outflow_Mm3;      // Water leaving the most downstream node
+    double end_water_Mm3;    // Water left in the riversystem
+    double waterbalance;     // start_water + inflow - end_water - outflow
 };
 //////////////////////////////////////////////////////////////////////////////////////////
 class QminPeriod {
@@ -337,7 +519,13 @@ class Qmin {
     bool qmin_flag;
     QminPeriod timeperiods[MAX_NUMBER_OF_QMIN_PERIODS];
     int nr_periods;
-    double calcQminRequirement(int year, int month, int day, double *cost );
+    double calcQminRequirement(int year, int month, int day, double *cost ) const;
+
+    // Requirement (m3/s) and penalty cost for every timestep, compiled from the periods
+    // and the calendar by CompileSeries() so the simulation does not have to do date arithmetic.
+    vector<double> req_series;
+    vector<double> cost_series;
+    void CompileSeries(const int *year, const int *month, const int *day, size_t stps);
 };
 //////////////////////////////////////////////////////////////////////////////////////////
 class Node {
@@ -346,14 +534,15 @@ class Node {
     virtual ~Node();
     NodeType nodetype;
     size_t idnr; // Specified by the user, muste be correct calculation order (accumulation levels)
-    Scenario *S;  // This will point to the correct scenario for the node.
+    size_t stps;
+    size_t dt;
+    Scenario *S;   // This will point to the correct scenario for the node (the main simulation).
+    const TimeAxis *timeaxis;  // Price and calendar, the same for all nodes and SystemStates
+    NodeState *X;  // Dynamic state of the node in the main simulation. 
     string nodename;
 
     Qmin qmin;  // We let all nodes have access to one Qmin object 
     bool qmin_in_use;  // Flag indicatin wether Qmin is used or not. 
-    double up_res_Mm3;   // Upstream reservoir volume - used in Powerstation. 
-    double remaining_available_Mm3;
-    double upstream_remaining_available_Mm3; // We accumulate as we go downward. 
 
     size_t reservoir_idnr;  // Used so we can go from node idnr to reservoir number. 
 
@@ -365,8 +554,6 @@ class Node {
     double powstat_min_discharge;  // We must place them here so we can accoes them through node pointer. 
     double powstat_max_discharge;
     double auto_qmin;
-    double start_of_stp_masl;
-    double end_of_stp_masl;
     
     bool downstream_node_in_use;
     bool outlet_hatch_in_use;
@@ -390,13 +577,31 @@ class Node {
     virtual int ReadStateFile(string filename);
     virtual int WriteStateFile(FILE *fp);
 
-    virtual int Simulate(size_t t);
+    // Simulate and GetTunnelFLow only change the state in Y, never the node itself, 
+    // so one node can be used by several simulations at the same time. 
+    virtual int Simulate(size_t t, SystemState *Y) const;
+    virtual int SimulateSeries(size_t t0, size_t t1, SystemState *Y) const;  // Timesteps [t0,t1) when all the input is known
+    virtual void CalcEconomics(size_t t0, size_t t1, Scenario *S) const;  // Income and costs in [t0,t1) from the simulated series
+    void AddToSums(size_t t0, size_t t1, Scenario *S, const double *discount) const;  // Adds [t0,t1) to the sums in S
+    virtual int InitState(NodeState *x) const;  // Set the state at the start of a simulation.
     virtual int initArrayCurves(void);
     virtual int CheckWaterBalance(void);
     virtual double GetStartWater_Mm3(void);
     virtual double GetEndWater_Mm3(void);
     virtual int WriteNodeOutput(GlobalConfig *gc);  // Write output for each node 
-    virtual double GetTunnelFLow(size_t t); // Used for reservoirs connected to a powerstation. 
+    virtual double GetTunnelFLow(size_t t, SystemState *Y) const; // Used for reservoirs connected to a powerstation. 
+
+    // The dynamic state in x at the start of timestep t, stored as StateSize() doubles in buf. 
+    // The series in the Scenario (up_inflow, costs etc.) are not included.
+    virtual size_t StateSize() const;
+    virtual void SaveState(size_t t, const NodeState *x, double *buf) const;
+    virtual void RestoreState(size_t t, NodeState *x, const double *buf) const;
+
+    // The same for all lanes in a LaneGroup.
+    virtual int Simulate(size_t t, LaneGroup *G) const;
+    virtual int InitState(LaneState *x) const;
+    virtual void GetTunnelFLow(size_t t, LaneGroup *G, double *flow) const;
+    virtual void GetEndWater_Mm3(LaneState *x, double *water) const;  // Adds the water in the node to water[HERSS_LANES]
 
     // Defining a function as virtual, means that it can be redefined in the child classes
     // This is an important feature since we can use the same function name, but execute different
@@ -408,8 +613,6 @@ class Reservoir: public Node {
     public:
     Reservoir();
     ~Reservoir();
-    size_t stps;
-    size_t dt;
 
     double reservoir_init_fr;
     double reservoir_init_masl;
@@ -418,13 +621,10 @@ class Reservoir: public Node {
     double filling_at_hrw_Mm3;  // Mm3
 
     double filling_at_hatchlevel;
-    double cost_lrw;
+    double filling_at_overflow_Mm3;  // Volume at the bottom point in the overflow curve, +inf if no overflow
     double res_LRW;             //  Lowest regulated water level [masl]
     double filling_at_lrw_Mm3;  // Mm3
     double res_penalty;
-    double res_Mm3;             //  Reservoir filling [Mm3]
-    double res_masl;            //  Reservoir filling [masl]
-    double res_fr;              //  Reservoir filling as a fraction of full.
     double res_curve_masl[MAX_NR_POINTS_CURVE];
     double res_curve_Mm3[MAX_NR_POINTS_CURVE];
     size_t nr_points_res_curve;
@@ -443,19 +643,25 @@ class Reservoir: public Node {
     // VIRTUAL FUNCTIONS USED IN RESERVOIR/CHANNEL/PSTATION
     int ReadNodeData(string filename);
     int ReadStateFile(string filename);
-    int Simulate(size_t t);
+    int Simulate(size_t t, SystemState *Y) const;
+    void CalcEconomics(size_t t0, size_t t1, Scenario *S) const;
+    int InitState(NodeState *x) const;
+    int Simulate(size_t t, LaneGroup *G) const;
+    int InitState(LaneState *x) const;
     int initArrayCurves(void);
     int CheckWaterBalance(void);
     int GetStartWater(void);
     int WriteStateFile(FILE *fp);
 
     // Functions used only in Reservoir
-    void InitReservoir(void);
-    double CalcOverflow();   // Mm3
+    void InitReservoir(NodeState *x) const;
+    double CalcOverflow(NodeState *x) const;   // Mm3
     double GetStartWater_Mm3(void);
     double GetEndWater_Mm3(void);
     int WriteNodeOutput(GlobalConfig *gc);  // Write output for each node 
-    double GetTunnelFLow(size_t t); // Used for reservoirs connected to a powerstation. 
+    double GetTunnelFLow(size_t t, SystemState *Y) const; // Used for reservoirs connected to a powerstation. 
+    void GetTunnelFLow(size_t t, LaneGroup *G, double *flow) const;
+    void GetEndWater_Mm3(LaneState *x, double *water) const;
 
 };
 /////////////////////////////////////////////////////////////////////////////////////////
@@ -463,8 +669,6 @@ class Powerstation: public Node {
     public:
     Powerstation();
     ~Powerstation();
-    size_t stps;
-    size_t dt;
     double init_Power;
 
     // Turbinvirkningsgrad - arrays
@@ -478,43 +682,73 @@ class Powerstation: public Node {
     double powstat_masl;
     double powstat_startstop;
 
+    // Optional table of the power as a function of discharge and gross head, see initPowerTable().
+    // The power is linear in the head, so for each discharge Q_i we store the power pr meter of 
+    // gross head and the power lost in the headloss, and interpolate linearly between Q_i and Q_i+1.
+    // This is the same as bilinear interpolation in a P(Q,H) table with any number of heads.
+    size_t power_table_points;    // Set from gc->power_table_points, 0 means no table.
+    double power_table_Qmin;
+    double power_table_Qmax;
+    double power_table_scale;     // (power_table_points-1)/(power_table_Qmax-power_table_Qmin)
+    vector<double> power_per_m;   // MWh pr m gross head at Q_i
+    vector<double> power_loss;    // MWh lost in the headloss at Q_i
+
     int ReadNodeData(string filename);
     int ReadStateFile(string filename);
-    int Simulate(size_t t);
+    int Simulate(size_t t, SystemState *Y) const;
+    int Simulate(size_t t, LaneGroup *G) const;
+    void CalcEconomics(size_t t0, size_t t1, Scenario *S) const;
+    int InitState(LaneState *x) const;
     int initArrayCurves(void);
     int CheckWaterBalance(void);
     double GetStartWater_Mm3(void);
     double GetEndWater_Mm3(void);
     int WriteNodeOutput(GlobalConfig *gc);  // Write output for each node 
-    double GetTunnelFLow(size_t t); 
+    double GetTunnelFLow(size_t t, SystemState *Y) const; 
+    void GetTunnelFLow(size_t t, LaneGroup *G, double *flow) const;
     int WriteStateFile(FILE *fp);
-    double CalcAdjustmenCosts(void); // Only for Powerstation 
+    bool DayEnds(int hour) const;
+    double AdjustmentCost(bool day_end, double previous_power, double Power, int *nr_adjustments) const;
+    size_t StateSize() const;
+    void SaveState(size_t t, const NodeState *x, double *buf) const;
+    void RestoreState(size_t t, NodeState *x, const double *buf) const;
+    double StartStopCost(double previous_power, double Power) const;
+    void initPowerTable(void);
+    double TablePower(double Q, double Hbrutto) const;  // Power [MWh] from the table, Q must be in [Qmin, Qmax)
 };
 /////////////////////////////////////////////////////////////////////////////////////////
 class Channel: public Node {
     public:
     Channel();
     ~Channel();
-    size_t stps;
-    size_t dt;
 
     size_t traveltime;
     double decay;
-    double waterflow_m3[MAX_TRAVELTIME_HOURS];  // Keeps track of how much water that is stored in the channel. [m3]
-    double init_waterflow_m3[MAX_TRAVELTIME_HOURS];  // Keeps track of how much water that is stored in the channel. [m3]
+    double init_waterflow_m3[MAX_TRAVELTIME_HOURS];  // Water stored in the channel at the start of the simulation. [m3]
 
     int ReadNodeData(string filename);
     int ReadStateFile(string filename);
-    int Simulate(size_t t);
+    int Simulate(size_t t, SystemState *Y) const;
+    int SimulateSeries(size_t t0, size_t t1, SystemState *Y) const;
+    void CalcEconomics(size_t t0, size_t t1, Scenario *S) const;
+    int InitState(NodeState *x) const;
+    int Simulate(size_t t, LaneGroup *G) const;
+    int InitState(LaneState *x) const;
     int initArrayCurves(void);
     int CheckWaterBalance(void);
     double GetStartWater_Mm3(void);
     double GetEndWater_Mm3(void);
     int WriteNodeOutput(GlobalConfig *gc);  // Write output for each node 
-    double GetTunnelFLow(size_t t);
+    double GetTunnelFLow(size_t t, SystemState *Y) const;
+    void GetTunnelFLow(size_t t, LaneGroup *G, double *flow) const;
+    void GetEndWater_Mm3(LaneState *x, double *water) const;
     int WriteStateFile(FILE *fp);
-    int SetStartState(void);
+    int SetStartState(NodeState *x) const;
+    size_t StateSize() const;
+    void SaveState(size_t t, const NodeState *x, double *buf) const;
+    void RestoreState(size_t t, NodeState *x, const double *buf) const;
     void PrintChannelWater(void);
+    size_t Part(size_t head, size_t s) const;  // Index in waterflow_m3 of part s of the channel
 
 };
 /////////////////////////////////////////////////////////////////////////////////////////
@@ -538,7 +772,6 @@ public:
     int nodes_idnrs[MAX_NR_NODES];
     double sum_prod_MWh;
     double sum_total_MWh; // Production pluss remaining in whole riversystem
-    double adjust_cost;   // Adjustment cost 
     
     double tot_remaining_available_Mm3;
     double tot_remaining_available_MWh;
@@ -546,6 +779,10 @@ public:
     double tot_income_Euro;
     double tot_cost_Euro;
     double tot_profit_Euro;
+    double pv_remaining_available_Euro;  // Present values, see GlobalConfig::SetDiscount().
+    double pv_income_Euro;               // The tot_ values above are nominal, as the sums below.
+    double pv_cost_Euro;
+    double pv_profit_Euro;
     double valuefunction_Euro;
     double sum_production;
     double avg_price;
@@ -562,6 +799,7 @@ public:
     Channel *channels;
     double Simulate(int id);
     double CalcVF(double restprice);
+    double CalcVF(double restprice, SystemState *Y) const;  // Only returns the VF, nothing is stored.
     double CalcSimulationProfit();
     int WriteRiverSystemData(double restprice);
     void WriteReservoirData();
@@ -582,15 +820,90 @@ public:
     size_t stps;        // How many time steps used in each scenario, and in the optimization step.
     size_t nr_nodes;    
     Riversystem *rs;
-    Scenario  **scen;
+    SystemState *state;     // State of the main simulation
+    Scenario  **scen;       // Same as state->scen
+    TimeAxis timeaxis;      // Price and calendar of all nodes
+    LaneGroup **workers;    // Used by SimulateBatch, one for each thread.
+    size_t nr_workers;
+    vector<EnsembleMember> ensemble;  // Results from SimulateEnsemble
+
+    // Simulate() saves the state every gc->checkpoint_interval timestep, and the next 
+    // Simulate() starts from the last checkpoint before the earliest changed input (dirty_t).
+    // Only the nodes that depend on the changed input are simulated again.
+    // If the input is changed without the Set functions below, call SetDirty(t).
+    size_t dirty_t;
+    size_t checkpoint_interval;  // gc->checkpoint_interval when the checkpoints were allocated
+    size_t nr_checkpoints;   // Valid checkpoints from the last Simulate()
+    size_t checkpoint_size;  // Nr of doubles in one checkpoint
+    size_t *state_offset;    // Where each node starts in a checkpoint
+    double *checkpoints;
+    vector< vector<size_t> > receivers;     // The nodes each node sends water to
+    vector< vector<size_t> > contributors;  // The nodes each node receives water from
+    vector<int> tunnel_source;              // The reservoir with a tunnel to the node, or -1
+    vector<bool> node_dirty;                // Nodes with new input since the last Simulate()
+    vector<bool> resimulate;                // Nodes simulated in the last Simulate()
+    vector<bool> rebuild_up_inflow;         // Nodes where up_inflow is added up again
+
+    // Node-major sweep (gc->node_major). A unit is a reservoir and the powerstation at the end of its
+    // tunnel, or a single node. Water from a contributor that runs out of order is sent to a detour
+    // buffer, and added to the receiver when its unit starts. See FindUnits.
+    vector< vector<size_t> > units;  // Nodes simulated together, in the order of the sweep
+    vector<size_t> unit_of;          // The unit of each node
+    vector<size_t> detour_from;      // Contributor that writes to a detour buffer
+    vector<size_t> detour_to;        // The receiver it would have written to
+    vector<Scenario*> detour_buf;    // Only up_inflow is used
+    bool node_major_ok;              // The sweep gives the same results as the time loop
+
+    // Used to stop Simulate(incumbent_vf, t_reached) early, see UpperBoundVF. 
+    vector<double> max_energy_MWh_Mm3;  // The most energy from one Mm3 in each node and below
+    vector<double> rest_MWh_Mm3;        // The most remaining energy at the end from one Mm3 in each node
+    vector<double> dead_rest_MWh_Mm3;   // The same for water below LRW
+    vector<double> dead_outflow_Mm3;    // The most water leaving a reservoir below LRW in one timestep
+    vector<double> max_power_MWh;       // The most each powerstation can produce in one timestep
+    bool capacity_bound_in_use;
+    vector<double> bound_price;           // [stps+1] Highest price from t and out (restprice at stps)
+    vector<double> bound_inflow_MWh;      // [stps+1] The most energy from the inflow from t and out
+    vector<double> bound_inflow_rest_MWh; // [stps+1] The most remaining energy from the inflow from t and out
+    vector<double> bound_capacity_Euro;   // [stps+1] Income with full production from t and out
+
+    // Snapshots of the main simulation for rollouts. Each saved state is 1 + checkpoint_size 
+    // doubles, t followed by the state of the nodes. 
+    size_t current_t;              // The next timestep to simulate
+    vector<double> saved_states;
 
     int prepaireSimulation(Dataset *data); // Read in final data and set pointers.
+    void SetNodePointers();                // Connect outlets to the downstream nodes.
     int Simulate();
+    int Simulate(double incumbent_vf, size_t *t_reached);  // Stops (returns 1) when VF cannot beat incumbent_vf.
+    bool HaveSeries(const char *function) const;  // False with VF_ONLY, where the output series are not stored.
+    void NeedSeries(const char *function) const;  // As HaveSeries, but stops the program.
+    void EndOfStep(size_t t0, size_t t, SystemState *Y, bool all_nodes, bool economics);  // Only with VF_ONLY
+    int CalcRemainingWater(SystemState *Y);
+    void SetDirty(size_t t);               // The input at t or later has changed.
+    void SetDirty(size_t t, size_t node_idnr);  // Only the input to node_idnr has changed.
+    void FindNodesToSimulate();
+    void CalcEnergyBounds();
+    double PrepareBound(size_t t0);
+    double UpperBoundVF(size_t t, double profit);
+    void FindUnits();
+    void SimulateUnit(size_t u, size_t t0, size_t t1, SystemState *Y, bool all_nodes);
+    void CalcEconomics(size_t t0, size_t t1, SystemState *Y, bool all_nodes);
+    void AllocateCheckpoints();
+    static constexpr size_t NO_HANDLE = ~size_t(0);  // From SaveState when nothing was saved
+    size_t SaveState(size_t t);            // Returns a handle to the saved state, NO_HANDLE with VF_ONLY.
+    int RestoreState(size_t handle);       // Returns -1 with VF_ONLY.
+    void ClearSavedStates();
+    int SimulateRange(size_t t0, size_t t1);  // Simulate timestep t0 to t1-1. Returns -1 with VF_ONLY.
+    int SimulateBatch(size_t K, double *actions, double *vf_out); // actions[K][stps][n_action_nodes]
+    int SimulateEnsemble(Dataset *data);   // Simulate all members in data->ensemble_inflow with the same actions.
+    int WriteEnsembleOutput();
+    size_t PrepareWorkers(size_t nr_groups);  // Returns the number of threads to use.
+    double Reprice(double *price, double restprice);  // New price on the last Simulate(), returns the VF.
+    int RepriceBatch(size_t K, double *prices, double *restprices, double *vf_out); // prices[K][stps], -1 with VF_ONLY
     int CheckWaterBalance();
     int GlobalWaterBalance(Dataset *data);
     int WriteNodeOutput();  // Write output for each node
     int WriteStateFile();  // Write output for each node
-    int CalcAdjustmenCosts();
     
     void SetAction(size_t node_idnr, size_t t, double value);
     double GetAction(size_t node_idnr, size_t t);
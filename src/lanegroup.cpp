@@ -0,0 +1,206 @@
+/********************************************************************************
+Project:      The Hydraulic Economic River System Simulator (HERSS)
+Filename:     lanegroup.cpp                                                       
+Developer:    Bernt Viggo Matheussen (Bernt.Viggo.Matheussen@aenergi.no)
+Organization: Å Energi, www.ae.no
+
+This software is released under the MIT license:
+
+Copyright (c) <2024> <Å Energi, Bernt Viggo Matheussen>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+********************************************************************************/
+
+#include "herss.h"
+
+LaneState::LaneState() {
+    inflow = NULL;
+    action = NULL;
+    income = NULL;
+    cost   = NULL;
+    channel_head = 0;
+    for(size_t l = 0; l < HERSS_LANES; l++) {
+        res_Mm3[l]                          = NOT_INIT;
+        res_masl[l]                         = NOT_INIT;
+        up_res_Mm3[l]                       = NOT_INIT;
+        start_of_stp_masl[l]                = NOT_INIT;
+        end_of_stp_masl[l]                  = NOT_INIT;
+        remaining_available_Mm3[l]          = NOT_INIT;
+        upstream_remaining_available_Mm3[l] = 0.0;
+        up_inflow[l]                        = 0.0;
+        prev_power[l]                       = NOT_INIT;
+        nr_adjustments[l]                   = 0;
+        sum_outflow_Mm3[l]                  = 0.0;
+        channel_storage_m3[l]               = NOT_INIT;
+    }
+}
+
+LaneState::~LaneState() {
+    delete [] inflow;
+    delete [] action;
+    delete [] income;
+    delete [] cost;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+LaneGroup::LaneGroup(GlobalConfig *gc, Riversystem *rs) {
+
+    this->nr_nodes = gc->nr_nodes;
+    this->stps     = gc->stps;
+    this->rs       = rs;
+    this->base     = NULL;
+
+    try {
+        ls = new LaneState[nr_nodes];
+        for(size_t n = 0; n < nr_nodes; n++) {
+            ls[n].inflow = new double[stps*HERSS_LANES];
+            ls[n].action = new double[stps*HERSS_LANES];
+            ls[n].income = new double[stps*HERSS_LANES];
+            ls[n].cost   = new double[stps*HERSS_LANES];
+        }
+    }
+    catch(std::bad_alloc& exc) {
+        printf("Error: memory allocation failed. \n"); 
+        printf("file: %s  linenr: %d  function: %s \n", __FILE__ , __LINE__, __FUNCTION__);
+        exit(EXIT_FAILURE);
+    }
+}
+///////////////////////////////////////////////////////////////////////////////
+LaneGroup::~LaneGroup() {
+    delete [] ls;
+}
+///////////////////////////////////////////////////////////////////////////////
+// All lanes start out with the inflow and actions in src. 
+void LaneGroup::SetInput(SystemState *src) {
+    this->base = src;
+    for(size_t n = 0; n < nr_nodes; n++) {
+        for(size_t t = 0; t < stps; t++) {
+            for(size_t l = 0; l < HERSS_LANES; l++) {
+                ls[n].inflow[t*HERSS_LANES + l] = src->scen[n]->inflow[t];
+                ls[n].action[t*HERSS_LANES + l] = src->scen[n]->action[t];
+            }
+        }
+    }
+}
+///////////////////////////////////////////////////////////////////////////////
+void LaneGroup::SetAction(size_t lane, size_t node_idnr, size_t t, double value) {
+    ls[node_idnr].action[t*HERSS_LANES + lane] = value;
+}
+///////////////////////////////////////////////////////////////////////////////
+void LaneGroup::SetInflow(size_t lane, size_t node_idnr, size_t t, double value) {
+    ls[node_idnr].inflow[t*HERSS_LANES + lane] = value;
+}
+///////////////////////////////////////////////////////////////////////////////
+int LaneGroup::Simulate() {
+
+    if(base == NULL) {
+        printf("ERROR: LaneGroup::SetInput() must be called before we can simulate\n");
+        printf("file: %s  linenr: %d  function: %s \n", __FILE__ , __LINE__, __FUNCTION__);
+        exit(EXIT_FAILURE);
+    }
+
+    for(size_t n = 0; n < nr_nodes; n++) {
+        rs->nodes[n]->InitState(&ls[n]);
+    }
+
+    // DO NOT CHANGE THIS AROUND - IT EFFECTS THE RESULTS
+    for( size_t t = 0; t < stps; ++t ) {
+        // Upstream inflow is only kept for the current timestep.
+        for(size_t n = 0; n < nr_nodes; n++) {
+            for(size_t l = 0; l < HERSS_LANES; l++) {
+                ls[n].up_inflow[l] = 0.0;
+            }
+        }
+        for(size_t n = 0; n < nr_nodes; n++) {
+            rs->nodes[n]->Simulate(t, this);
+        }
+    }
+
+    // Accumulate remaining water downwards, as in Herss::Simulate.
+    for(size_t n = 0; n < nr_nodes; n++) {
+        if(rs->nodes[n]->ptr_downstream_node != NULL) {
+            LaneState *xd = &ls[rs->nodes[n]->downstream_idnr];
+            for(size_t l = 0; l < HERSS_LANES; l++) {
+                xd->upstream_remaining_available_Mm3[l] += 
+                    (ls[n].remaining_available_Mm3[l] + ls[n].upstream_remaining_available_Mm3[l]);
+            }
+        }
+    }
+    return 0;
+}
+///////////////////////////////////////////////////////////////////////////////
+// The value function of each lane. The sums are done in the same order as in 
+// Riversystem::CalcVF, so each lane gets the same value as a scalar simulation. 
+void LaneGroup::CalcVF(double restprice, double *vf) {
+
+    double remaining_MWh[HERSS_LANES];
+    double income[HERSS_LANES];
+    double cost[HERSS_LANES];
+
+    for(size_t l = 0; l < HERSS_LANES; l++) {
+        remaining_MWh[l] = 0.0;
+        income[l]        = 0.0;
+        cost[l]          = 0.0;
+    }
+
+    for(size_t n = 0; n < nr_nodes; n++) {
+        if(rs->nodes[n]->nodetype == NodeType::POWERSTATION) { 
+            for(size_t l = 0; l < HERSS_LANES; l++) {
+                remaining_MWh[l] += (rs->nodes[n]->local_energy_equivalent * ls[n].upstream_remaining_available_Mm3[l] * 1000000.0 / 1000.0); // MWh
+            }
+        }
+    }
+
+    // Present values of each node are summed first, as in Node::AddToSums
+    const double *discount = rs->gc->discount.data();
+    for(size_t n = 0; n < nr_nodes; n++) {
+        double node_income[HERSS_LANES];
+        double node_cost[HERSS_LANES];
+        for(size_t l = 0; l < HERSS_LANES; l++) {
+            node_income[l] = 0.0;
+            node_cost[l]   = 0.0;
+        }
+        for(size_t t = 0; t < stps; t++) {
+            for(size_t l = 0; l < HERSS_LANES; l++) {
+                node_income[l] += discount[t] * ls[n].income[t*HERSS_LANES + l];
+                node_cost[l]   += discount[t] * ls[n].cost[t*HERSS_LANES + l];
+            }
+        }
+        for(size_t l = 0; l < HERSS_LANES; l++) {
+            income[l] += node_income[l];
+            cost[l]   += node_cost[l];
+        }
+    }
+
+    for(size_t l = 0; l < HERSS_LANES; l++) {
+        vf[l] = (income[l] - cost[l]) + remaining_MWh[l]*restprice*discount[stps];
+    }
+}
+///////////////////////////////////////////////////////////////////////////////
+// Total water in the riversystem at the end of the simulation, summed in the same 
+// order as in Herss::GlobalWaterBalance.
+void LaneGroup::GetEndWater_Mm3(double *water) {
+    for(size_t l = 0; l < HERSS_LANES; l++) {
+        water[l] = 0.0;
+    }
+    for(size_t n = 0; n < nr_nodes; n++) {
+        rs->nodes[n]->GetEndWater_Mm3(&ls[n], water);
+    }
+}
+///////////////////////////////////////////////////////////////////////////////
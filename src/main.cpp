@@ -64,18 +64,26 @@ int main(int argc, char *argv[]) {
     herss->Simulate();
     herss->CheckWaterBalance();
     herss->GlobalWaterBalance(data);
-    herss->CalcAdjustmenCosts();
     printf("ValueFunction = %.5f\n", herss->rs->CalcVF(data->restprice));
     
     // Now we need to write output to files
+    // With VF_ONLY there are no series to write, only the sums and the state at the end.
     herss->rs->WriteRiverSystemData(data->restprice);
-    herss->rs->WriteReservoirData();
+    if(!gc->vf_only) {
+        herss->rs->WriteReservoirData();
+    }
     herss->WriteStateFile();
 
-    if(gc->write_nodefiles) {
+    if(gc->write_nodefiles && !gc->vf_only) {
         herss->WriteNodeOutput();
     }  
 
+    // Same actions, but with all the inflow series in INFLOW_ENSEMBLE.
+    if(data->nr_members > 0) {
+        herss->SimulateEnsemble(data);
+        herss->WriteEnsembleOutput();
+    }
+
 
     delete herss;
     delete data;
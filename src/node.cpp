@@ -31,7 +31,11 @@ SOFTWARE.
 
 Node::Node() {
     idnr                     = NOT_INIT;
+    stps                     = 0;
+    dt                       = 0;
     S                        = NULL;
+    timeaxis                 = NULL;
+    X                        = NULL;
     nodename                 = STR_NOT_INIT;
     downstream_node_in_use   = false;
     outlet_hatch_in_use      = false;
@@ -39,11 +43,7 @@ Node::Node() {
     outlet_overflow_in_use   = false;
     outlet_auto_qmin_in_use  = false;
     auto_qmin                = NOT_INIT;
-    start_of_stp_masl        = NOT_INIT;
-    end_of_stp_masl          = NOT_INIT;
     qmin_in_use              = false;
-    remaining_available_Mm3  = NOT_INIT;
-    upstream_remaining_available_Mm3 = 0.0; // To make things easier. 
 
     ptr_downstream_node           = NULL;
     ptr_downstream_node_tunnel    = NULL;
@@ -57,11 +57,99 @@ Node::~Node() {}
 // VIRTUAL FUNCTIONS
 int Node::ReadNodeData(string filename)             { return 0; }
 int Node::ReadStateFile(string filename)            { return 0; }
-int Node::Simulate(size_t t)                        { return 0; }
+int Node::Simulate(size_t t, SystemState *Y) const { return 0; }
 int Node::initArrayCurves(void)                     { return 0; }
 int Node::CheckWaterBalance(void)                   { return 0; }
 double Node::GetStartWater_Mm3(void)                { return 0; }
 double Node::GetEndWater_Mm3(void)                  { return 0; } 
 int Node::WriteNodeOutput(GlobalConfig *gc )        { return 0; }
-double Node::GetTunnelFLow(size_t t)                { return 0; }
+double Node::GetTunnelFLow(size_t t, SystemState *Y) const { return 0; }
 int Node::WriteStateFile(FILE *fp)                  { return 0; }
+int Node::Simulate(size_t t, LaneGroup *G) const    { return 0; }
+void Node::GetTunnelFLow(size_t t, LaneGroup *G, double *flow) const {}
+void Node::GetEndWater_Mm3(LaneState *x, double *water) const {}
+
+// Upstream inflow is accumulated (+=) by the upstream nodes while we simulate, 
+// so it must be set to zero before every new simulation.
+int Node::InitState(NodeState *x) const {
+    for(size_t t = 0; t < x->S->stored; t++ ) {
+        x->S->up_inflow[t] = 0.0;
+    }
+    x->remaining_available_Mm3          = 0.0;
+    x->upstream_remaining_available_Mm3 = 0.0;
+    x->nr_adjustments                   = 0;
+    return 0;
+}
+
+// Nodes without a faster way just simulate one timestep at a time.
+int Node::SimulateSeries(size_t t0, size_t t1, SystemState *Y) const {
+    for(size_t t = t0; t < t1; t++) {
+        Simulate(t, Y);
+    }
+    return 0;
+}
+
+// Nodes without income or costs.
+void Node::CalcEconomics(size_t t0, size_t t1, Scenario *S) const {
+    for(size_t t = t0; t < t1; t++) {
+        size_t ts = t & S->mask;
+        S->income[ts] = 0.0;
+        S->cost[ts]   = 0.0;
+    }
+}
+
+// The sums are added one timestep at a time from t = 0, so they are the same however 
+// the simulation was split up.
+void Node::AddToSums(size_t t0, size_t t1, Scenario *S, const double *discount) const {
+    for(size_t t = t0; t < t1; t++) {
+        size_t ts = t & S->mask;
+        S->sum_income_Euro      += S->income[ts];
+        S->sum_cost_Euro        += S->cost[ts];
+        S->pv_income_Euro       += discount[t] * S->income[ts];
+        S->pv_cost_Euro         += discount[t] * S->cost[ts];
+        S->sum_local_inflow_Mm3 += MACRO_m3s_2_Mm3(S->inflow[t], dt);
+        S->sum_inflow_Mm3       += MACRO_m3s_2_Mm3( (S->inflow[t] + S->up_inflow[ts]) , dt);
+        S->sum_outflow_Mm3      += MACRO_m3s_2_Mm3(S->tot_outflow[ts], dt);
+    }
+    if(this->nodetype == NodeType::POWERSTATION) {
+        for(size_t t = t0; t < t1; t++) {
+            size_t ts = t & S->mask;
+            S->sum_prod_MWh         += S->Power[ts];
+            S->sum_adjust_cost_Euro += S->adjust_cost[ts];
+        }
+    }
+}
+
+// The variables in NodeState that are carried from one timestep to the next. 
+size_t Node::StateSize() const { return 7; }
+
+void Node::SaveState(size_t t, const NodeState *x, double *buf) const {
+    buf[0] = x->res_Mm3;
+    buf[1] = x->res_masl;
+    buf[2] = x->res_fr;
+    buf[3] = x->up_res_Mm3;
+    buf[4] = x->start_of_stp_masl;
+    buf[5] = x->end_of_stp_masl;
+    buf[6] = x->remaining_available_Mm3;
+}
+
+void Node::RestoreState(size_t t, NodeState *x, const double *buf) const {
+    x->res_Mm3                 = buf[0];
+    x->res_masl                = buf[1];
+    x->res_fr                  = buf[2];
+    x->up_res_Mm3              = buf[3];
+    x->start_of_stp_masl       = buf[4];
+    x->end_of_stp_masl         = buf[5];
+    x->remaining_available_Mm3 = buf[6];
+}
+
+// In a LaneGroup the upstream inflow is set to zero at the start of every timestep.
+int Node::InitState(LaneState *x) const {
+    for(size_t l = 0; l < HERSS_LANES; l++) {
+        x->up_inflow[l]                        = 0.0;
+        x->remaining_available_Mm3[l]          = 0.0;
+        x->upstream_remaining_available_Mm3[l] = 0.0;
+        x->sum_outflow_Mm3[l]                  = 0.0;
+    }
+    return 0;
+}
@@ -31,8 +31,6 @@ SOFTWARE.
 #include "herss.h"
 
 Powerstation::Powerstation(){
-    stps = 0;
-    dt   = 0;
     nr_points_turb_virkn = 0;
     static_gen_efficiency   = NOT_INIT;
     headlosscoef            = NOT_INIT;
@@ -41,6 +39,10 @@ Powerstation::Powerstation(){
     powstat_max_discharge   = NOT_INIT;
     powstat_startstop       = NOT_INIT;
     init_Power              = NOT_INIT;
+    power_table_points      = 0;
+    power_table_Qmin        = NOT_INIT;
+    power_table_Qmax        = NOT_INIT;
+    power_table_scale       = NOT_INIT;
 }
 
 Powerstation::~Powerstation(){}
@@ -53,12 +55,59 @@ int Powerstation::initArrayCurves(void) {
         ac_turbvirkn_curve.y_points[p] = turb_virkn_psnt[p];
     }
     ac_turbvirkn_curve.initializeArrays();
+    initPowerTable();
     return 0;
 }
 ////////////////////////////////////////////////////////////////
-int Powerstation::Simulate(size_t t) {
-    this->dt     = S->dt;
-    this->stps   = S->stps;
+// The table covers the turbine efficiency curve. Discharges outside it are calculated exactly.
+void Powerstation::initPowerTable(void) {
+
+    power_per_m.clear();
+    power_loss.clear();
+    if(this->power_table_points == 0) {
+        return;
+    }
+    if(this->power_table_points < 2) {
+        printf("POWER_TABLE_POINTS must be 0 or at least 2 \n");
+        printf( "NODE POWERSTATION idnr=%d  nodename=%s\n", int(idnr), nodename.c_str()  );
+        printf("file: %s  linenr: %d  function: %s \n", __FILE__ , __LINE__, __FUNCTION__);
+        exit(EXIT_FAILURE);
+    }
+
+    size_t N = this->power_table_points;
+    power_table_Qmin  = ac_turbvirkn_curve.xmin;
+    power_table_Qmax  = ac_turbvirkn_curve.xmax;
+    power_table_scale = (N-1)/(power_table_Qmax - power_table_Qmin);
+    power_per_m.resize(N);
+    power_loss.resize(N);
+
+    for(size_t i = 0; i < N; i++) {
+        double Q = power_table_Qmin + i*(power_table_Qmax - power_table_Qmin)/(N-1);
+        double turbine_efficiency = ac_turbvirkn_curve.x2y(Q)/100.0;
+        double P = turbine_efficiency * 1000 * GRAVITY * Q;  // Watt pr m
+        P = P /1000000.0; // MW
+        P = P * static_gen_efficiency; 
+        power_per_m[i] = P * dt / 3600.0; // MWh
+        power_loss[i]  = power_per_m[i] * this->headlosscoef * Q * Q;
+    }
+}
+////////////////////////////////////////////////////////////////
+double Powerstation::TablePower(double Q, double Hbrutto) const {
+    double pos = (Q - power_table_Qmin) * power_table_scale;
+    size_t i = size_t(pos);
+    if(i > power_table_points-2) {
+        i = power_table_points-2;  // Q just below Qmax may round up to the last point
+    }
+    double w = pos - i;
+    double per_m = power_per_m[i] + w*(power_per_m[i+1] - power_per_m[i]);
+    double loss  = power_loss[i]  + w*(power_loss[i+1]  - power_loss[i]);
+    return per_m * Hbrutto - loss;
+}
+////////////////////////////////////////////////////////////////
+int Powerstation::Simulate(size_t t, SystemState *Y) const {
+    NodeState *x = &Y->ns[idnr];
+    Scenario *S  = x->S;
+    size_t ts = t & S->mask;  // Where timestep t is stored in the output series
     double Q;
     double headloss;
     double Hbrutto;
@@ -66,62 +115,128 @@ int Powerstation::Simulate(size_t t) {
     double turbine_efficiency;
     double P;
     double Power;
-    double income;
-    double startstopCost;
-    double previous_power = 0.0;
-
-    if( t ==0 ) {
-        previous_power = this->init_Power;
-    } else {
-        previous_power = S->Power[t-1];
-    }
 
-    Q = S->up_inflow[t];
+    Q = S->up_inflow[ts];
 
     headloss = this->headlosscoef * Q * Q;
-    Hbrutto  = ((this->start_of_stp_masl + this->end_of_stp_masl)/2.0 ) - this->powstat_masl;
+    Hbrutto  = ((x->start_of_stp_masl + x->end_of_stp_masl)/2.0 ) - this->powstat_masl;
     Hnetto   = Hbrutto - headloss;
-    turbine_efficiency = ac_turbvirkn_curve.x2y(Q)/100.0;
 
-    P = turbine_efficiency * 1000 * GRAVITY * Hnetto * Q;  // Watt
-    P = P /1000000.0; // MW
-    P = P * static_gen_efficiency; 
-    Power = P * dt / 3600.0; // MWh
+    if(this->power_table_points > 0 && Q >= power_table_Qmin && Q < power_table_Qmax) {
+        Power = TablePower(Q, Hbrutto);
+    } else {
+        turbine_efficiency = ac_turbvirkn_curve.x2y(Q)/100.0;
+
+        P = turbine_efficiency * 1000 * GRAVITY * Hnetto * Q;  // Watt
+        P = P /1000000.0; // MW
+        P = P * static_gen_efficiency; 
+        Power = P * dt / 3600.0; // MWh
+    }
 
     if(Q < this->powstat_min_discharge) {
         Power = 0.0;
     }   
 
-    income = Power * S->price[t];
-
-    // Now we check for start and stop costs
-    // We penalise when starting and stopping. 
-    startstopCost = 0.0;
-    
-    if(previous_power > 0.001 and Power < 0.001) {
-        startstopCost = this->powstat_startstop/2.0;
+    // We do allow for a powerstation to be the most downstream node in the riversystem. 
+    if(this->ptr_downstream_node != NULL) {
+        Y->scen[downstream_idnr]->up_inflow[ts] += Q;
     }
 
-    if(previous_power < 0.001 and Power > 0.001) {
-        startstopCost = this->powstat_startstop/2.0;
+    // The adjustment cost needs the count from the earlier timesteps of the day, so unlike 
+    // the other costs it is found here. CalcEconomics adds it to the cost.
+    double previous_power = (t == 0) ? this->init_Power : S->Power[(t-1) & S->mask];
+    S->adjust_cost[ts] = AdjustmentCost(DayEnds(timeaxis->hour[t]), previous_power, Power, &x->nr_adjustments);
+
+    // Save timeseries, the income and costs are calculated afterwards in CalcEconomics.
+    S->Hnetto[ts]          = Hnetto;
+    S->Hbrutto[ts]         = Hbrutto;
+    S->Power[ts]           = Power;
+    S->tot_outflow[ts]     = Q;
+    x->remaining_available_Mm3 = 0.0;  // The powerstation can never store water.
+
+    return 0;
+}
+////////////////////////////////////////////////////////////////
+// Income and start/stop costs from the production. The start/stop cost only needs the 
+// production in the timestep before, so there are no dependencies between the timesteps.
+// The adjustment cost is set by Simulate.
+void Powerstation::CalcEconomics(size_t t0, size_t t1, Scenario *S) const {
+    for(size_t t = t0; t < t1; t++) {
+        size_t ts = t & S->mask;
+        S->income[ts] = S->Power[ts] * timeaxis->price[t];
+    }
+    for(size_t t = t0; t < t1; t++) {
+        size_t ts = t & S->mask;
+        double previous_power = (t == 0) ? this->init_Power : S->Power[(t-1) & S->mask];
+        S->cost[ts]   = StartStopCost(previous_power, S->Power[ts]) + S->adjust_cost[ts];
+        S->profit[ts] = S->income[ts] - S->cost[ts];
+    }
+}
+////////////////////////////////////////////////////////////////
+int Powerstation::InitState(LaneState *x) const {
+    Node::InitState(x);
+    for(size_t l = 0; l < HERSS_LANES; l++) {
+        x->prev_power[l] = this->init_Power;
+        x->nr_adjustments[l] = 0;
+    }
+    return 0;
+}
+////////////////////////////////////////////////////////////////
+// The same calculations as Simulate(t, Y), but for all lanes in G at the same time.
+int Powerstation::Simulate(size_t t, LaneGroup *G) const {
+
+    LaneState *x = &G->ls[idnr];
+    double *income = x->income + t*HERSS_LANES;
+    double *cost   = x->cost   + t*HERSS_LANES;
+    double efficiency[HERSS_LANES];
+    bool day_end = DayEnds(timeaxis->hour[t]);
+
+    // As in Simulate(t, Y) the power table is used when Q is inside it, so the 
+    // turbine efficiency is only looked up if some lane is outside the table.
+    bool use_table[HERSS_LANES];
+    bool all_table = true;
+    for(size_t l = 0; l < HERSS_LANES; l++) {
+        double Q = x->up_inflow[l];
+        use_table[l] = this->power_table_points > 0 && Q >= power_table_Qmin && Q < power_table_Qmax;
+        all_table = all_table && use_table[l];
+    }
+    if(!all_table) {
+        ac_turbvirkn_curve.x2y_lanes(x->up_inflow, efficiency);
     }
 
+    for(size_t l = 0; l < HERSS_LANES; l++) {
+        double Q = x->up_inflow[l];
+        double headloss = this->headlosscoef * Q * Q;
+        double Hbrutto  = ((x->start_of_stp_masl[l] + x->end_of_stp_masl[l])/2.0 ) - this->powstat_masl;
+        double Hnetto   = Hbrutto - headloss;
+        double Power;
+        if(use_table[l]) {
+            Power = TablePower(Q, Hbrutto);
+        } else {
+            double turbine_efficiency = efficiency[l]/100.0;
+
+            double P = turbine_efficiency * 1000 * GRAVITY * Hnetto * Q;  // Watt
+            P = P /1000000.0; // MW
+            P = P * static_gen_efficiency; 
+            Power = P * dt / 3600.0; // MWh
+        }
+        Power = (Q < this->powstat_min_discharge) ? 0.0 : Power;
+
+        double previous_power = x->prev_power[l];
+        income[l] = Power * timeaxis->price[t];
+        cost[l]   = StartStopCost(previous_power, Power) + AdjustmentCost(day_end, previous_power, Power, &x->nr_adjustments[l]);
+        x->prev_power[l] = Power;
+        x->sum_outflow_Mm3[l] += MACRO_m3s_2_Mm3(Q, dt);
+        x->remaining_available_Mm3[l] = 0.0;  // The powerstation can never store water.
+    }
 
     // We do allow for a powerstation to be the most downstream node in the riversystem. 
     if(this->ptr_downstream_node != NULL) {
-        this->ptr_downstream_node->S->up_inflow[t] += Q;
+        LaneState *xd = &G->ls[downstream_idnr];
+        for(size_t l = 0; l < HERSS_LANES; l++) {
+            xd->up_inflow[l] += x->up_inflow[l];
+        }
     }
-
-    // Save timeseries 
-    S->income[t]           = income;
-    S->cost[t]             = startstopCost;
-    S->profit[t]           = income - startstopCost;
-    S->Hnetto[t]           = Hnetto;
-    S->Hbrutto[t]          = Hbrutto;
-    S->Power[t]            = Power;
-    S->tot_outflow[t]      = Q;
-    remaining_available_Mm3 = 0.0;  // The powerstation can never store water.
-
     return 0;
 }
 ////////////////////////////////////////////////////////////////
@@ -356,10 +471,8 @@ int Powerstation::CheckWaterBalance(void) {
 
     double sum_inflow  = 0.0;
     double sum_outflow = 0.0;
-    for(size_t t = 0; t < this->stps; t++) {
-        sum_inflow += MACRO_m3s_2_Mm3( (this->S->inflow[t] + this->S->up_inflow[t]) , dt);
-        sum_outflow += MACRO_m3s_2_Mm3(this->S->tot_outflow[t], dt);
-    }
+    sum_inflow  = this->S->sum_inflow_Mm3;
+    sum_outflow = this->S->sum_outflow_Mm3;
 
     double waterbalance = sum_inflow - sum_outflow;
 
@@ -376,12 +489,12 @@ int Powerstation::CheckWaterBalance(void) {
         printf( "WATERBALANCE POWERSTATION idnr=%d  nodename=%s\n", int(idnr), nodename.c_str()  );
         sum_inflow  = 0.0;
         sum_outflow = 0.0;
-        for(size_t t = 0; t < this->stps; t++) {
+        for(size_t t = 0; t < this->stps && S->stored == this->stps; t++) {  // Not with VF_ONLY
             sum_inflow += MACRO_m3s_2_Mm3( (this->S->inflow[t] + this->S->up_inflow[t]) , dt);
             sum_outflow += MACRO_m3s_2_Mm3(this->S->tot_outflow[t], dt);
 
             printf("%d %d %d %d %d %.5f %.5f %.5f  action %.5f  sum_in= %.6f  sum_out= %.6f diff= %.6f \n", int(t), 
-            S->year[t], S->month[t], S->day[t], S->hour[t], 
+            timeaxis->year[t], timeaxis->month[t], timeaxis->day[t], timeaxis->hour[t], 
             MACRO_m3s_2_Mm3(this->S->inflow[t], dt), 
             MACRO_m3s_2_Mm3(this->S->up_inflow[t], dt ),
             MACRO_m3s_2_Mm3(this->S->tot_outflow[t], dt), S->action[t] ,
@@ -430,8 +543,8 @@ int Powerstation::WriteNodeOutput(GlobalConfig *gc) {
     fprintf(fp, "yyyy mm dd hh Up_Inflow Price      Action tot_outflow auto_qmin income startstopCost Hnetto Hbrutto Power adjust_cost\n");
 
     for(size_t t = 0; t < this->stps; t++) {
-        fprintf(fp, "%d %d %d %d ", S->year[t], S->month[t], S->day[t], S->hour[t]);
-        fprintf(fp, "%.4f %.4f %.4f ", S->up_inflow[t] , S->price[t], S->action[t] );
+        fprintf(fp, "%d %d %d %d ", timeaxis->year[t], timeaxis->month[t], timeaxis->day[t], timeaxis->hour[t]);
+        fprintf(fp, "%.4f %.4f %.4f ", S->up_inflow[t] , timeaxis->price[t], S->action[t] );
         fprintf(fp, "%.4f ", S->tot_outflow[t]);
         fprintf(fp, "%.4f ", S->auto_qmin_m3s[t]);
         fprintf(fp, "%.4f ", S->income[t]);
@@ -447,16 +560,19 @@ int Powerstation::WriteNodeOutput(GlobalConfig *gc) {
     return 0;
 }
 //////////////////////////////////////////////////////////////////////////////////
-double Powerstation::GetTunnelFLow(size_t t) {
+double Powerstation::GetTunnelFLow(size_t t, SystemState *Y) const {
 
     // WORK IN PROGRESS
+    NodeState *x = &Y->ns[idnr];
+    Scenario *S  = x->S;
+    size_t ts = t & S->mask;  // Where timestep t is stored in the output series
     double flow = 0.0;
        
-    S->auto_qmin_m3s[t] = 0.0; 
+    S->auto_qmin_m3s[ts] = 0.0; 
 
     if(S->action[t] < -0.000001) {
         printf("ERROR: action is negative \n");
-        printf ("NODE PSTATION %d %s action= %.5f\n", int(idnr), nodename.c_str(), this->S->action[t]);
+        printf ("NODE PSTATION %d %s action= %.5f\n", int(idnr), nodename.c_str(), S->action[t]);
         printf("file: %s  linenr: %d  function: %s \n", __FILE__ , __LINE__, __FUNCTION__);
         exit(EXIT_FAILURE);
     }
@@ -470,51 +586,112 @@ double Powerstation::GetTunnelFLow(size_t t) {
     // Here we check the auto qmin water release in downstream connected Powerstation
     if(auto_qmin > 0.0 && flow < auto_qmin) {
         flow = auto_qmin;
-        S->auto_qmin_m3s[t] = flow; 
+        S->auto_qmin_m3s[ts] = flow; 
     }   
 
     double Q_Mm3 = MACRO_m3s_2_Mm3(flow, S->dt);
 
     // We shut down production and auto_qmin if the reservoir is dry or water level below tunnel 
-    if(Q_Mm3 > up_res_Mm3) {
+    if(Q_Mm3 > x->up_res_Mm3) {
         flow = 0.0;
     }
 
     return flow;
 }
 //////////////////////////////////////////////////////////////////////////////////
+// The same as GetTunnelFLow(t, Y), for all lanes in G. The result is stored in flow[HERSS_LANES].
+void Powerstation::GetTunnelFLow(size_t t, LaneGroup *G, double *flow) const {
+
+    LaneState *x = &G->ls[idnr];
+    const double *action = x->action + t*HERSS_LANES;
+
+    for(size_t l = 0; l < HERSS_LANES; l++) {
+        if(action[l] < -0.000001) {
+            printf("ERROR: action is negative \n");
+            printf ("NODE PSTATION %d %s action= %.5f lane=%lu\n", int(idnr), nodename.c_str(), action[l], l);
+            printf("file: %s  linenr: %d  function: %s \n", __FILE__ , __LINE__, __FUNCTION__);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for(size_t l = 0; l < HERSS_LANES; l++) {
+        double f = (action[l] < 0.01) ? 0.0 : this->powstat_min_discharge + action[l] * (this->powstat_max_discharge - this->powstat_min_discharge);  // m3/s
+
+        // Auto qmin water release
+        f = (auto_qmin > 0.0 && f < auto_qmin) ? auto_qmin : f;
+
+        // We shut down production and auto_qmin if the reservoir is dry or water level below tunnel 
+        double Q_Mm3 = MACRO_m3s_2_Mm3(f, dt);
+        flow[l] = (Q_Mm3 > x->up_res_Mm3[l]) ? 0.0 : f;
+    }
+}
+//////////////////////////////////////////////////////////////////////////////////
 int Powerstation::WriteStateFile(FILE *fp) {
-    fprintf (fp, "NODE PSTATION %d %s %.5f\n", int(idnr), nodename.c_str(), this->S->Power[S->stps-1]);
+    fprintf (fp, "NODE PSTATION %d %s %.5f\n", int(idnr), nodename.c_str(), this->S->Power[(S->stps-1) & S->mask]);
     return 0;
 }
 //////////////////////////////////////////////////////////////////////////////////
-double Powerstation::CalcAdjustmenCosts(void) {
-
-    double prev_power = init_Power;
-    double diff;
-    int nr_changes_pr_day = 0;
-    double sum_cost = 0.0;
-    for(size_t t = 0; t < S->stps; t++) {
-        diff = abs(prev_power - S->Power[t]);
-
-        // We define a change of 0.1 MW as significant
-        if(diff > 0.1) {
-            nr_changes_pr_day++;
-        }
+// The power in the previous timestep is read from the series, so it is saved together 
+// with the node state and written back to the series when the state is restored. 
+// The number of adjustments so far in the day is saved as well.
+size_t Powerstation::StateSize() const {
+    return Node::StateSize() + 2;
+}
+//////////////////////////////////////////////////////////////////////////////////
+void Powerstation::SaveState(size_t t, const NodeState *x, double *buf) const {
+    Node::SaveState(t, x, buf);
+    buf[Node::StateSize()]     = (t == 0) ? this->init_Power : x->S->Power[(t-1) & x->S->mask];
+    buf[Node::StateSize() + 1] = double(x->nr_adjustments);
+}
+//////////////////////////////////////////////////////////////////////////////////
+void Powerstation::RestoreState(size_t t, NodeState *x, const double *buf) const {
+    Node::RestoreState(t, x, buf);
+    if(t > 0) {
+        x->S->Power[(t-1) & x->S->mask] = buf[Node::StateSize()];
+    }
+    x->nr_adjustments = int(buf[Node::StateSize() + 1]);
+}
+//////////////////////////////////////////////////////////////////////////////////
+// Now we check for start and stop costs
+// We penalise when starting and stopping. 
+double Powerstation::StartStopCost(double previous_power, double Power) const {
+    double startstopCost = 0.0;
+    
+    if(previous_power > 0.001 and Power < 0.001) {
+        startstopCost = this->powstat_startstop/2.0;
+    }
 
-        if(t > 2) {
-            if((t+1) % 24 == 0) {
-                if(nr_changes_pr_day > this->max_adjustment_pr_day) {
-                    sum_cost += this->max_adjustment_cost;
-                    S->adjust_cost[t]  = this->max_adjustment_cost;
-                    S->cost[t]        += this->max_adjustment_cost;
-                    S->profit[t]      -= this->max_adjustment_cost;
-                } 
-                nr_changes_pr_day = 0;
-            }
-        }
-        prev_power = S->Power[t];
+    if(previous_power < 0.001 and Power > 0.001) {
+        startstopCost = this->powstat_startstop/2.0;
     }
-    return sum_cost;
+    return startstopCost;
+}
+//////////////////////////////////////////////////////////////////////////////////
+// A timestep is the last one of its day when it ends at or after midnight. The calendar 
+// gives the hour the timestep starts, so this works for any DT, also when the data does not 
+// start at midnight. 
+bool Powerstation::DayEnds(int hour) const {
+    return size_t(hour)*3600 + dt >= 24*3600;
 }
 //////////////////////////////////////////////////////////////////////////////////
+// Counts the changes in production during the day. At the last timestep of the day the 
+// count is reset, and the cost of breaking the maximum number of adjustments pr day is returned.
+double Powerstation::AdjustmentCost(bool day_end, double previous_power, double Power, int *nr_adjustments) const {
+    if(this->max_adjustment_pr_day < 1) {
+        return 0.0;
+    }
+
+    // We define a change of 0.1 MW as significant
+    if(abs(previous_power - Power) > 0.1) {
+        (*nr_adjustments)++;
+    }
+
+    double adjust_cost = 0.0;
+    if(day_end) {
+        if(*nr_adjustments > this->max_adjustment_pr_day) {
+            adjust_cost = this->max_adjustment_cost;
+        }
+        *nr_adjustments = 0;
+    }
+    return adjust_cost;
+}
@@ -29,10 +29,13 @@ SOFTWARE.
 
 #include "herss.h"
 
-Qmin::Qmin(){}
+Qmin::Qmin(){
+    qmin_flag  = false;
+    nr_periods = 0;
+}
 Qmin::~Qmin(){}
 
-double Qmin::calcQminRequirement(int year, int month, int day, double *cost) {
+double Qmin::calcQminRequirement(int year, int month, int day, double *cost) const {
 
     DateTime qmin_startdate;
     DateTime qmin_enddate;
@@ -50,3 +53,17 @@ double Qmin::calcQminRequirement(int year, int month, int day, double *cost) {
     }
     return 0.0;
 }
+/////////////////////////////////////////////////////////////////////
+// Evaluates the periods once for each timestep in the calendar. Timesteps outside all 
+// periods get no requirement and no cost.
+void Qmin::CompileSeries(const int *year, const int *month, const int *day, size_t stps) {
+
+    req_series.assign(stps, 0.0);
+    cost_series.assign(stps, 0.0);
+
+    for(size_t t = 0; t < stps; t++) {
+        double cost = 0.0;
+        req_series[t]  = calcQminRequirement(year[t], month[t], day[t], &cost);
+        cost_series[t] = cost;
+    }
+}
@@ -28,6 +28,7 @@ SOFTWARE.
 ********************************************************************************/
 
 #include "herss.h"
+#include <limits>
 
 Reservoir::Reservoir(){
     reservoir_init_fr              = NOT_INIT;
@@ -37,12 +38,10 @@ Reservoir::Reservoir(){
     res_HRW                        = NOT_INIT;
     filling_at_hrw_Mm3             = NOT_INIT;
     filling_at_hatchlevel          = NOT_INIT;
+    filling_at_overflow_Mm3        = NOT_INIT;
     res_LRW                        = NOT_INIT;
     filling_at_lrw_Mm3             = NOT_INIT;
     res_penalty                    = NOT_INIT;
-    res_Mm3                        = NOT_INIT;
-    res_masl                       = NOT_INIT;
-    res_fr                         = NOT_INIT;
     nr_points_res_curve            = 0;
     nr_points_ovefl_curve          = 0;
     outlet_hatch_in_use            = false;
@@ -92,10 +91,27 @@ int Reservoir::initArrayCurves(void) {
     }
     ac_ovefl_m3s_2_masl.initializeArrays();
 
+    // These volumes never change, so we calculate them here and not every time we simulate.
+    filling_at_lrw_Mm3 = ac_res_masl_2_Mm3.x2y(this->res_LRW);
+    filling_at_hrw_Mm3 = ac_res_masl_2_Mm3.x2y(this->res_HRW);
+    if(outlet_hatch_in_use) {
+        filling_at_hatchlevel = ac_res_masl_2_Mm3.x2y(this->hatch_masl);
+    }
+    // The overflow crest may be outside the reservoir curve. Above it the reservoir never 
+    // overflows, and below it the level is always looked up, as before we had this volume.
+    filling_at_overflow_Mm3 = numeric_limits<double>::infinity();
+    if(nr_points_ovefl_curve > 0) {
+        if(this->ovefl_curve_masl[0] < ac_res_masl_2_Mm3.xmin) {
+            filling_at_overflow_Mm3 = ac_res_masl_2_Mm3.ymin;
+        } else if(this->ovefl_curve_masl[0] < ac_res_masl_2_Mm3.xmax) {
+            filling_at_overflow_Mm3 = ac_res_masl_2_Mm3.x2y(this->ovefl_curve_masl[0]);
+        }
+    }
+
     return 0;
 }
 ////////////////////////////////////////////////////////////////
-double Reservoir::CalcOverflow() {
+double Reservoir::CalcOverflow(NodeState *x) const {
 
     double masl_start_overflow;
     double overflow_m3s;
@@ -108,9 +124,15 @@ double Reservoir::CalcOverflow() {
 
     masl_start_overflow = this->ovefl_curve_masl[0];
 
+    // We only look up the level when the volume is above the bottom point in the overflow curve.
+    double res_masl = masl_start_overflow;
+    if(x->res_Mm3 > filling_at_overflow_Mm3) {
+        res_masl = ac_res_Mm3_2_masl.x2y(x->res_Mm3);
+    }
+
     // The bottom point in the overflow curve is usually the same as HRW, but not always.
-    if(this->res_masl > masl_start_overflow) {
-        overflow_m3s = ac_ovefl_masl_2_m3s.x2y(this->res_masl);
+    if(res_masl > masl_start_overflow) {
+        overflow_m3s = ac_ovefl_masl_2_m3s.x2y(res_masl);
         overflow_Mm3 = MACRO_m3s_2_Mm3(overflow_m3s,dt);
 
         // We cannot allow the overflow to drain more than down to the top of the dam ( for now we assume HRW).
@@ -119,7 +141,7 @@ double Reservoir::CalcOverflow() {
         // when the reservoirlevel drops from one point to below another one.
         // Maybe we need to use the old way of looping over all the points defining the reservoir and overflow curves.
         // WORK IN PROGRESS
-        current_filling  = this->res_Mm3; 
+        current_filling  = x->res_Mm3; 
 
         max_overflow = current_filling - filling_at_hrw_Mm3;
 
@@ -137,11 +159,13 @@ double Reservoir::CalcOverflow() {
     return overflow_Mm3;
 }
 ////////////////////////////////////////////////////////////////
-void Reservoir::InitReservoir(void) {
-
-    for(size_t t = 0; t < S->stps; t++ ) {
-        S->up_inflow[t]    = 0.0;
-    }
+int Reservoir::InitState(NodeState *x) const {
+    Node::InitState(x);
+    InitReservoir(x);
+    return 0;
+}
+////////////////////////////////////////////////////////////////
+void Reservoir::InitReservoir(NodeState *x) const {
 
     if(this->nr_points_res_curve < 2) {
         printf("Reservoir curve not initialized\n");
@@ -156,26 +180,19 @@ void Reservoir::InitReservoir(void) {
         exit(EXIT_FAILURE);
     }
 
-    filling_at_lrw_Mm3 = ac_res_masl_2_Mm3.x2y(this->res_LRW);
-    filling_at_hrw_Mm3 = ac_res_masl_2_Mm3.x2y(this->res_HRW);
-
-    res_Mm3 = filling_at_lrw_Mm3 + reservoir_init_fr * (filling_at_hrw_Mm3 - filling_at_lrw_Mm3);
+    x->res_Mm3 = filling_at_lrw_Mm3 + reservoir_init_fr * (filling_at_hrw_Mm3 - filling_at_lrw_Mm3);
 
     // Note that reservoir content is the water between HRW and LRW.
     // That volume cannot be used directly to calculate the filling in meters above sea level.
-    res_masl = ac_res_Mm3_2_masl.x2y(res_Mm3);
-
-    // Calculate filling at hatch level here so do it only once, and not every timestep.
-    if(outlet_hatch_in_use) {
-        filling_at_hatchlevel = ac_res_masl_2_Mm3.x2y(this->hatch_masl);
-    }
+    x->res_masl = ac_res_Mm3_2_masl.x2y(x->res_Mm3);
 }
 ////////////////////////////////////////////////////////////////
-int Reservoir::Simulate(size_t t) {
+int Reservoir::Simulate(size_t t, SystemState *Y) const {
     
     // Upstream inflow has already been set to zero or adjusted earlier.
-    this->dt     = S->dt;
-    this->stps   = S->stps;
+    NodeState *x = &Y->ns[idnr];
+    Scenario *S  = x->S;
+    size_t ts = t & S->mask;  // Where timestep t is stored in the output series
 
     double hatchflow_Mm3;
     double tunnelflow_Mm3;
@@ -183,8 +200,6 @@ int Reservoir::Simulate(size_t t) {
     double outlet_auto_qmin_flow_Mm3;
     double total_inflow_Mm3;
     double max_hatchflow;
-    double current_filling;
-    current_filling = -999.0; // To void warning
 
     #ifdef HERSS_DEBUG_ALL
         if( S->inflow[t] < 0.0 || S->inflow[t] > 5000.0) {
@@ -194,30 +209,28 @@ int Reservoir::Simulate(size_t t) {
             exit(EXIT_FAILURE);
         }
 
-        if( S->price[t] < 0.0 || S->price[t] > 5000.0) {
-            printf("Reservoir::Simulate() There is something wrong with price =%.3f\n", S->price[t]);
+        if( timeaxis->price[t] < 0.0 || timeaxis->price[t] > 5000.0) {
+            printf("Reservoir::Simulate() There is something wrong with price =%.3f\n", timeaxis->price[t]);
             printf("Node idnr = %d   nodename = %s", int(this->idnr) , this->nodename.c_str() );
             printf("file: %s  linenr: %d\n", __FILE__ , __LINE__);
             exit(EXIT_FAILURE);
         }
     #endif
 
-    total_inflow_Mm3 = S->inflow[t]+S->up_inflow[t];
+    total_inflow_Mm3 = S->inflow[t]+S->up_inflow[ts];
     total_inflow_Mm3 = MACRO_m3s_2_Mm3(total_inflow_Mm3,dt);
 
     // Add local inflow
-    this->res_Mm3 += MACRO_m3s_2_Mm3(S->inflow[t],this->dt);    // Mm3
-
-    S->sum_local_inflow_Mm3 += MACRO_m3s_2_Mm3(S->inflow[t],this->dt);    // Mm3
+    x->res_Mm3 += MACRO_m3s_2_Mm3(S->inflow[t],dt);    // Mm3
 
     // Add upstream inflow
-    this->res_Mm3 += MACRO_m3s_2_Mm3(S->up_inflow[t],this->dt);  // Mm3   All initialized to zero 
-
-    // Update filling height
-    this->res_masl = ac_res_Mm3_2_masl.x2y(this->res_Mm3);
+    x->res_Mm3 += MACRO_m3s_2_Mm3(S->up_inflow[ts],dt);  // Mm3   All initialized to zero 
 
     //---------------------------------------------------------------------
     // We have maximum four outlets. Tunnel, Hatch, auto_qmin_hatch, Overflow
+    // The outlets are calculated in volume space, using the volumes at the hatch level and 
+    // the start of the overflow found in initArrayCurves. The filling height is only looked 
+    // up for the head of the powerstation, the overflow curve and at the end of the timestep.
     // We start with TUNNEL
     // CASE A: Normal production.
     // CASE B: Auto_Qmin. 
@@ -229,80 +242,71 @@ int Reservoir::Simulate(size_t t) {
             printf("ERROR IN RESERVOIR:  Something is wrong with the pointer:  ptr_downstream_node_tunnel \n");
             printf("idnr=%d  nodename=%s   timestep=%lu \n", int(idnr) , nodename.c_str() , t );
             printf("file: %s  linenr: %d  function: %s \n", __FILE__ , __LINE__, __FUNCTION__);
-            printf("res_masl     = %.5f\n", this->res_masl);
+            printf("res_Mm3      = %.5f\n", x->res_Mm3);
             exit(EXIT_FAILURE);
         }
 
-        ptr_downstream_node_tunnel->start_of_stp_masl = this->res_masl;
-        ptr_downstream_node_tunnel->up_res_Mm3 = this->res_Mm3;
-        double tunnelf_m3s = ptr_downstream_node_tunnel->GetTunnelFLow(t);
-        ptr_downstream_node_tunnel->S->up_inflow[t] = tunnelf_m3s;
-        tunnelflow_Mm3 = MACRO_m3s_2_Mm3(tunnelf_m3s ,this->dt);  // Mm3   All initialized to zero
+        // Update filling height
+        x->res_masl = ac_res_Mm3_2_masl.x2y(x->res_Mm3);
+
+        NodeState *xt = &Y->ns[downstream_idnr_tunnel];
+        xt->start_of_stp_masl = x->res_masl;
+        xt->up_res_Mm3 = x->res_Mm3;
+        double tunnelf_m3s = ptr_downstream_node_tunnel->GetTunnelFLow(t, Y);
+        xt->S->up_inflow[ts] = tunnelf_m3s;
+        tunnelflow_Mm3 = MACRO_m3s_2_Mm3(tunnelf_m3s ,dt);  // Mm3   All initialized to zero
     }
 
-    this->res_Mm3 -= tunnelflow_Mm3;
-    this->res_masl = ac_res_Mm3_2_masl.x2y(this->res_Mm3);
+    x->res_Mm3 -= tunnelflow_Mm3;
 
     //-------------------------------------------------------------------
     // OUTLET HATCH, typically to channel 
     hatchflow_Mm3 = 0.0;
     if(outlet_hatch_in_use){
-        if(this->res_masl > this->hatch_masl ) {
+        if(x->res_Mm3 > filling_at_hatchlevel ) {
             // Some places we need to release water regardless of the actions set 
             // This can be done by setting minQ_hatch to a low level.
             hatchflow_Mm3 = this->minQ_hatch + S->action[t]*(this->maxQ_hatch - this->minQ_hatch);
             hatchflow_Mm3 = MACRO_m3s_2_Mm3(hatchflow_Mm3, dt);  // Mm3
-            current_filling = ac_res_masl_2_Mm3.x2y(this->res_masl);
-            max_hatchflow = current_filling - filling_at_hatchlevel;
+            max_hatchflow = x->res_Mm3 - filling_at_hatchlevel;
             if (hatchflow_Mm3 > max_hatchflow) {
                 hatchflow_Mm3 = max_hatchflow;
             }
         }
-        ptr_downstream_node_hatch->S->up_inflow[t] += MACRO_Mm3_2_m3s(hatchflow_Mm3, dt);  // m3/s
+        Y->scen[downstream_idnr_hatch]->up_inflow[ts] += MACRO_Mm3_2_m3s(hatchflow_Mm3, dt);  // m3/s
     }
-    this->res_Mm3 -= hatchflow_Mm3;
-
-    // Update the reservoir masl
-    this->res_masl = ac_res_Mm3_2_masl.x2y(this->res_Mm3);
+    x->res_Mm3 -= hatchflow_Mm3;
 
     // AUTO HATCH 
     outlet_auto_qmin_flow_Mm3 = 0.0;
     // Here we simulate the effect of an automatic water release set by the operators.
     if(outlet_auto_qmin_in_use){
-        double void_cost;
-        outlet_auto_qmin_flow_Mm3 = this->qmin.calcQminRequirement(S->year[t], S->month[t], S->day[t],  &void_cost  );  // m3/s
-        this->ptr_downstream_node_auto_qmin->S->up_inflow[t] += outlet_auto_qmin_flow_Mm3;
+        outlet_auto_qmin_flow_Mm3 = this->qmin.req_series[t];  // m3/s
+        Y->scen[downstream_idnr_auto_qmin]->up_inflow[ts] += outlet_auto_qmin_flow_Mm3;
     }
 
     outlet_auto_qmin_flow_Mm3 = MACRO_m3s_2_Mm3(outlet_auto_qmin_flow_Mm3, dt);  // Mm3
-    this->res_Mm3 -= outlet_auto_qmin_flow_Mm3;
-    // Update the reservoir masl
-    this->res_masl = ac_res_Mm3_2_masl.x2y(this->res_Mm3);
+    x->res_Mm3 -= outlet_auto_qmin_flow_Mm3;
 
     // Overflow is always used
-    overflow_Mm3 = this->CalcOverflow();
-    ptr_downstream_node_overflow->S->up_inflow[t] += MACRO_Mm3_2_m3s(overflow_Mm3, dt);  // m3/s
-
-    this->res_Mm3 -= overflow_Mm3;
-    this->res_masl = ac_res_Mm3_2_masl.x2y(this->res_Mm3);
+    overflow_Mm3 = this->CalcOverflow(x);
+    Y->scen[downstream_idnr_overflow]->up_inflow[ts] += MACRO_Mm3_2_m3s(overflow_Mm3, dt);  // m3/s
 
-    cost_lrw = 0.0;
-    if( this->res_masl  < this->res_LRW) {
-        cost_lrw = this->res_penalty*dt/3600;
-    }
+    x->res_Mm3 -= overflow_Mm3;
+    x->res_masl = ac_res_Mm3_2_masl.x2y(x->res_Mm3);
 
     if(outlet_tunnel_in_use) {
-        ptr_downstream_node_tunnel->end_of_stp_masl = this->res_masl;
+        Y->ns[downstream_idnr_tunnel].end_of_stp_masl = x->res_masl;
     }
 
 
     // Fractional_filling
-    double fract_filling = (res_Mm3  - filling_at_lrw_Mm3) / (filling_at_hrw_Mm3 - filling_at_lrw_Mm3);
+    double fract_filling = (x->res_Mm3  - filling_at_lrw_Mm3) / (filling_at_hrw_Mm3 - filling_at_lrw_Mm3);
 
-    remaining_available_Mm3 = res_Mm3  - filling_at_lrw_Mm3;
+    x->remaining_available_Mm3 = x->res_Mm3  - filling_at_lrw_Mm3;
 
-    if(remaining_available_Mm3 < 0.0) {
-        remaining_available_Mm3 = 0.0; // Used to calculate remaining available energy in system. Cannot be negative.
+    if(x->remaining_available_Mm3 < 0.0) {
+        x->remaining_available_Mm3 = 0.0; // Used to calculate remaining available energy in system. Cannot be negative.
     }
 
     if(fract_filling < -1.0) {
@@ -310,7 +314,7 @@ int Reservoir::Simulate(size_t t) {
         printf("There is obviously something wrong with the fract_filling calculations => NON PHYSICAL SITUATIONS \n");
         printf( "idnr=%d  nodename=%s   timestep=%lu \n", int(idnr) , nodename.c_str() , t );
         printf("file: %s  linenr: %d  function: %s \n", __FILE__ , __LINE__, __FUNCTION__);
-        printf("current_filling     = %.5f\n", res_Mm3);
+        printf("current_filling     = %.5f\n", x->res_Mm3);
         printf("filling_at_lrw_Mm3  = %.5f\n", filling_at_lrw_Mm3 );
         printf("filling_at_hrw_Mm3  = %.5f\n", filling_at_hrw_Mm3);
         printf("fract_filling       = %.5f\n", fract_filling);
@@ -318,23 +322,221 @@ int Reservoir::Simulate(size_t t) {
     }
 
 
-    this->res_fr = fract_filling;
+    x->res_fr = fract_filling;
 
     // Transfer timeseries 
-    S->tot_inflow[t]   = MACRO_Mm3_2_m3s(total_inflow_Mm3,dt);
-    S->res_Mm3[t]      = res_Mm3;
-    S->res_masl[t]     = res_masl;
-    S->res_fr[t]       = fract_filling;
-    S->overflow_Mm3[t] = overflow_Mm3;
-    S->cost[t]         = cost_lrw;
+    S->tot_inflow[ts]   = MACRO_Mm3_2_m3s(total_inflow_Mm3,dt);
+    S->res_Mm3[ts]      = x->res_Mm3;
+    S->res_masl[ts]     = x->res_masl;
+    S->res_fr[ts]       = fract_filling;
+    S->overflow_Mm3[ts] = overflow_Mm3;
 
     double tot_out     = hatchflow_Mm3 + tunnelflow_Mm3 + overflow_Mm3 + outlet_auto_qmin_flow_Mm3;
-    S->tot_outflow[t]  = MACRO_Mm3_2_m3s(tot_out, dt);
-    S->tunnelflow_m3s[t]  = MACRO_Mm3_2_m3s(tunnelflow_Mm3, dt);
-    S->hatchflow_m3s[t]   = MACRO_Mm3_2_m3s(hatchflow_Mm3, dt);
-    S->overflow_m3s[t]    = MACRO_Mm3_2_m3s(overflow_Mm3, dt);
-    S->auto_qmin_m3s[t]   = MACRO_Mm3_2_m3s(outlet_auto_qmin_flow_Mm3, dt);
-    S->income[t]  = 0.0;  // No income in reservoirs 
+    S->tot_outflow[ts]    = MACRO_Mm3_2_m3s(tot_out, dt);
+    S->tunnelflow_m3s[ts] = MACRO_Mm3_2_m3s(tunnelflow_Mm3, dt);
+    S->hatchflow_m3s[ts]  = MACRO_Mm3_2_m3s(hatchflow_Mm3, dt);
+    S->overflow_m3s[ts]   = MACRO_Mm3_2_m3s(overflow_Mm3, dt);
+    S->auto_qmin_m3s[ts]  = MACRO_Mm3_2_m3s(outlet_auto_qmin_flow_Mm3, dt);
+
+    return 0;
+}
+////////////////////////////////////////////////////////////////
+// The penalty for being below LRW at the end of the timestep.
+void Reservoir::CalcEconomics(size_t t0, size_t t1, Scenario *S) const {
+    for(size_t t = t0; t < t1; t++) {
+        size_t ts = t & S->mask;
+        S->cost[ts]   = (S->res_masl[ts] < this->res_LRW) ? this->res_penalty*dt/3600 : 0.0;
+        S->income[ts] = 0.0;  // No income in reservoirs 
+    }
+}
+////////////////////////////////////////////////////////////////
+int Reservoir::InitState(LaneState *x) const {
+    Node::InitState(x);
+
+    NodeState start;
+    InitReservoir(&start);
+    for(size_t l = 0; l < HERSS_LANES; l++) {
+        x->res_Mm3[l]  = start.res_Mm3;
+        x->res_masl[l] = start.res_masl;
+    }
+    return 0;
+}
+////////////////////////////////////////////////////////////////
+// The same calculations as Simulate(t, Y), but for all lanes in G at the same time. 
+// Instead of if-tests on each outlet we calculate the flow in all lanes and 
+// select the result with a mask. Lanes where an outlet is closed only do a 
+// dummy lookup in the curve at xmin, so that the lookup never fails.
+int Reservoir::Simulate(size_t t, LaneGroup *G) const {
+
+    LaneState *x = &G->ls[idnr];
+    const double *inflow = x->inflow + t*HERSS_LANES;
+    const double *action = x->action + t*HERSS_LANES;
+
+    double tunnelflow_Mm3[HERSS_LANES];
+    double hatchflow_Mm3[HERSS_LANES];
+    double overflow_Mm3[HERSS_LANES];
+    double lookup[HERSS_LANES];
+    double curve[HERSS_LANES];
+    bool open[HERSS_LANES];
+
+    #ifdef HERSS_DEBUG_ALL
+        for(size_t l = 0; l < HERSS_LANES; l++) {
+            if( inflow[l] < 0.0 || inflow[l] > 5000.0) {
+                printf("Reservoir::Simulate() There is something wrong with inflow =%.3f in lane %lu\n", inflow[l], l);
+                printf("Node idnr = %d   nodename = %s", int(this->idnr) , this->nodename.c_str() );
+                printf("file: %s  linenr: %d\n", __FILE__ , __LINE__);
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        if( timeaxis->price[t] < 0.0 || timeaxis->price[t] > 5000.0) {
+            printf("Reservoir::Simulate() There is something wrong with price =%.3f\n", timeaxis->price[t]);
+            printf("Node idnr = %d   nodename = %s", int(this->idnr) , this->nodename.c_str() );
+            printf("file: %s  linenr: %d\n", __FILE__ , __LINE__);
+            exit(EXIT_FAILURE);
+        }
+    #endif
+
+    // Add local and upstream inflow
+    for(size_t l = 0; l < HERSS_LANES; l++) {
+        x->res_Mm3[l] += MACRO_m3s_2_Mm3(inflow[l],dt);
+        x->res_Mm3[l] += MACRO_m3s_2_Mm3(x->up_inflow[l],dt);
+    }
+
+    // TUNNEL
+    for(size_t l = 0; l < HERSS_LANES; l++) {
+        tunnelflow_Mm3[l] = 0.0;
+    }
+    if(outlet_tunnel_in_use) {
+        if(ptr_downstream_node_tunnel    == NULL) {
+            printf("ERROR IN RESERVOIR:  Something is wrong with the pointer:  ptr_downstream_node_tunnel \n");
+            printf("idnr=%d  nodename=%s   timestep=%lu \n", int(idnr) , nodename.c_str() , t );
+            printf("file: %s  linenr: %d  function: %s \n", __FILE__ , __LINE__, __FUNCTION__);
+            exit(EXIT_FAILURE);
+        }
+
+        ac_res_Mm3_2_masl.x2y_lanes(x->res_Mm3, x->res_masl);
+        LaneState *xt = &G->ls[downstream_idnr_tunnel];
+        for(size_t l = 0; l < HERSS_LANES; l++) {
+            xt->start_of_stp_masl[l] = x->res_masl[l];
+            xt->up_res_Mm3[l]        = x->res_Mm3[l];
+        }
+        ptr_downstream_node_tunnel->GetTunnelFLow(t, G, xt->up_inflow);
+        for(size_t l = 0; l < HERSS_LANES; l++) {
+            tunnelflow_Mm3[l] = MACRO_m3s_2_Mm3(xt->up_inflow[l] ,dt);
+        }
+    }
+
+    for(size_t l = 0; l < HERSS_LANES; l++) {
+        x->res_Mm3[l] -= tunnelflow_Mm3[l];
+    }
+
+    // OUTLET HATCH
+    for(size_t l = 0; l < HERSS_LANES; l++) {
+        hatchflow_Mm3[l] = 0.0;
+    }
+    if(outlet_hatch_in_use){
+        LaneState *xh = &G->ls[downstream_idnr_hatch];
+        for(size_t l = 0; l < HERSS_LANES; l++) {
+            bool open_hatch = x->res_Mm3[l] > filling_at_hatchlevel;
+            double hatchflow = this->minQ_hatch + action[l]*(this->maxQ_hatch - this->minQ_hatch);
+            hatchflow = MACRO_m3s_2_Mm3(hatchflow, dt);
+            double max_hatchflow = x->res_Mm3[l] - filling_at_hatchlevel;
+            hatchflow = (hatchflow > max_hatchflow) ? max_hatchflow : hatchflow;
+            hatchflow_Mm3[l] = open_hatch ? hatchflow : 0.0;
+            xh->up_inflow[l] += MACRO_Mm3_2_m3s(hatchflow_Mm3[l], dt);  // m3/s
+        }
+    }
+    for(size_t l = 0; l < HERSS_LANES; l++) {
+        x->res_Mm3[l] -= hatchflow_Mm3[l];
+    }
+
+    // AUTO HATCH, follows the calendar and is the same in all lanes. 
+    double outlet_auto_qmin_flow_Mm3 = 0.0;
+    if(outlet_auto_qmin_in_use){
+        outlet_auto_qmin_flow_Mm3 = this->qmin.req_series[t];  // m3/s
+        LaneState *xq = &G->ls[downstream_idnr_auto_qmin];
+        for(size_t l = 0; l < HERSS_LANES; l++) {
+            xq->up_inflow[l] += outlet_auto_qmin_flow_Mm3;
+        }
+    }
+    outlet_auto_qmin_flow_Mm3 = MACRO_m3s_2_Mm3(outlet_auto_qmin_flow_Mm3, dt);  // Mm3
+    for(size_t l = 0; l < HERSS_LANES; l++) {
+        x->res_Mm3[l] -= outlet_auto_qmin_flow_Mm3;
+    }
+
+    // Overflow is always used. The curves are only used if the volume in a lane is above 
+    // the bottom point in the overflow curve, as in CalcOverflow.
+    double masl_start_overflow = this->ovefl_curve_masl[0];
+    bool any_open = false;
+    for(size_t l = 0; l < HERSS_LANES; l++) {
+        open[l]   = x->res_Mm3[l] > filling_at_overflow_Mm3;
+        lookup[l] = open[l] ? x->res_Mm3[l] : ac_res_Mm3_2_masl.xmin;
+        curve[l]  = 0.0;
+        any_open |= open[l];
+    }
+    if(any_open) {
+        ac_res_Mm3_2_masl.x2y_lanes(lookup, curve);
+        for(size_t l = 0; l < HERSS_LANES; l++) {
+            open[l]   = open[l] && curve[l] > masl_start_overflow;
+            lookup[l] = open[l] ? curve[l] : ac_ovefl_masl_2_m3s.xmin;
+        }
+        ac_ovefl_masl_2_m3s.x2y_lanes(lookup, curve);
+    }
+    bool negative_overflow = false;
+    for(size_t l = 0; l < HERSS_LANES; l++) {
+        double overflow = MACRO_m3s_2_Mm3(curve[l],dt);
+        double max_overflow = x->res_Mm3[l] - filling_at_hrw_Mm3;
+        overflow = (overflow > max_overflow) ? max_overflow : overflow;
+        overflow_Mm3[l] = open[l] ? overflow : 0.0;
+        negative_overflow |= (overflow_Mm3[l] < 0.0);
+    }
+    if(negative_overflow) {
+        printf("Negative overflow is not allowed \n");
+        printf("file: %s  linenr: %d\n", __FILE__ , __LINE__);
+        exit(0);
+    }
+
+    LaneState *xo = &G->ls[downstream_idnr_overflow];
+    for(size_t l = 0; l < HERSS_LANES; l++) {
+        xo->up_inflow[l] += MACRO_Mm3_2_m3s(overflow_Mm3[l], dt);  // m3/s
+        x->res_Mm3[l] -= overflow_Mm3[l];
+
+        double tot_out     = hatchflow_Mm3[l] + tunnelflow_Mm3[l] + overflow_Mm3[l] + outlet_auto_qmin_flow_Mm3;
+        double tot_outflow = MACRO_Mm3_2_m3s(tot_out, dt);
+        x->sum_outflow_Mm3[l] += MACRO_m3s_2_Mm3(tot_outflow, dt);
+    }
+    ac_res_Mm3_2_masl.x2y_lanes(x->res_Mm3, x->res_masl);
+
+    if(outlet_tunnel_in_use) {
+        LaneState *xt = &G->ls[downstream_idnr_tunnel];
+        for(size_t l = 0; l < HERSS_LANES; l++) {
+            xt->end_of_stp_masl[l] = x->res_masl[l];
+        }
+    }
+
+    double *income = x->income + t*HERSS_LANES;
+    double *cost   = x->cost   + t*HERSS_LANES;
+    bool non_physical = false;
+    for(size_t l = 0; l < HERSS_LANES; l++) {
+        cost[l]   = ( x->res_masl[l]  < this->res_LRW) ? this->res_penalty*dt/3600 : 0.0;
+        income[l] = 0.0;  // No income in reservoirs 
+
+        double fract_filling = (x->res_Mm3[l]  - filling_at_lrw_Mm3) / (filling_at_hrw_Mm3 - filling_at_lrw_Mm3);
+        non_physical |= (fract_filling < -1.0);
+
+        // Used to calculate remaining available energy in system. Cannot be negative.
+        double remaining = x->res_Mm3[l]  - filling_at_lrw_Mm3;
+        x->remaining_available_Mm3[l] = (remaining < 0.0) ? 0.0 : remaining;
+    }
+
+    if(non_physical) {
+        printf("ERROR\n");
+        printf("There is obviously something wrong with the fract_filling calculations => NON PHYSICAL SITUATIONS \n");
+        printf( "idnr=%d  nodename=%s   timestep=%lu \n", int(idnr) , nodename.c_str() , t );
+        printf("file: %s  linenr: %d  function: %s \n", __FILE__ , __LINE__, __FUNCTION__);
+        exit(EXIT_FAILURE);
+    }
 
     return 0;
 }
@@ -612,19 +814,15 @@ int Reservoir::ReadStateFile(string filename){
 int Reservoir::CheckWaterBalance(void) { 
 
     // Starting water volume.
-    filling_at_lrw_Mm3 = ac_res_masl_2_Mm3.x2y(this->res_LRW);
-    filling_at_hrw_Mm3 = ac_res_masl_2_Mm3.x2y(this->res_HRW);
     double start_res_Mm3 = filling_at_lrw_Mm3 + reservoir_init_fr * (filling_at_hrw_Mm3 - filling_at_lrw_Mm3);
     double sum_inflow  = 0.0;
     double sum_outflow = 0.0;
 
-    for(size_t t = 0; t < this->stps; t++) {
-        sum_inflow += MACRO_m3s_2_Mm3( (this->S->inflow[t] + this->S->up_inflow[t]) , dt);
-        sum_outflow += MACRO_m3s_2_Mm3(this->S->tot_outflow[t], dt);
-    }
+    sum_inflow  = this->S->sum_inflow_Mm3;
+    sum_outflow = this->S->sum_outflow_Mm3;
 
     // Ending water volume
-    double end_res_Mm3 = this->res_Mm3;
+    double end_res_Mm3 = X->res_Mm3;
     double waterbalance = start_res_Mm3 + sum_inflow - end_res_Mm3 - sum_outflow;
 
 
@@ -657,15 +855,13 @@ int Reservoir::CheckWaterBalance(void) {
 //------------------------------------------------------------------------
 double Reservoir::GetStartWater_Mm3(void) {
     // Starting water volume.
-    filling_at_lrw_Mm3 = ac_res_masl_2_Mm3.x2y(this->res_LRW);
-    filling_at_hrw_Mm3 = ac_res_masl_2_Mm3.x2y(this->res_HRW);
     double start_res_Mm3 = filling_at_lrw_Mm3 + reservoir_init_fr * (filling_at_hrw_Mm3 - filling_at_lrw_Mm3);
     return start_res_Mm3;
 }
 //------------------------------------------------------------------------
 double Reservoir::GetEndWater_Mm3(void) {
     // Ending water volume
-    return this->res_Mm3;  // This is the water in the reservoir at the end of the last timestep
+    return X->res_Mm3;  // This is the water in the reservoir at the end of the last timestep
 }
 //------------------------------------------------------------------------
 int Reservoir::WriteNodeOutput(GlobalConfig *gc){
@@ -690,8 +886,8 @@ int Reservoir::WriteNodeOutput(GlobalConfig *gc){
     fprintf(fp, "yyyy mm dd hh Inflow Price Action Up_Inflow Res_Mm3 Res_masl Res_fr lrw_cost tunnelflow hatchflow overflow auto_qmin tot_outflow\n");
 
     for(size_t t = 0; t < this->stps; t++) {
-        fprintf(fp, "%d %d %d %d ", S->year[t], S->month[t], S->day[t], S->hour[t]);
-        fprintf(fp, "%.4f %.4f %.4f ", S->inflow[t] , S->price[t], S->action[t] );
+        fprintf(fp, "%d %d %d %d ", timeaxis->year[t], timeaxis->month[t], timeaxis->day[t], timeaxis->hour[t]);
+        fprintf(fp, "%.4f %.4f %.4f ", S->inflow[t] , timeaxis->price[t], S->action[t] );
         fprintf(fp, "%.4f ", S->up_inflow[t]);
         fprintf(fp, "%.4f %.4f %.4f ", S->res_Mm3[t] , S->res_masl[t], S->res_fr[t] );
         fprintf(fp, "%.4f ", S->cost[t]);
@@ -703,16 +899,26 @@ int Reservoir::WriteNodeOutput(GlobalConfig *gc){
     return 0;
 }
 /////////////////////////////////////////////////////////////////////////
-double Reservoir::GetTunnelFLow(size_t t) {
+double Reservoir::GetTunnelFLow(size_t t, SystemState *Y) const {
     printf("ERROR reservoir cannot use this function. \n");
     printf ("NODE RESERVOIR %d %s\n", int(idnr), nodename.c_str());
     printf("file: %s  linenr: %d  function: %s \n", __FILE__ , __LINE__, __FUNCTION__);
     exit(EXIT_FAILURE);
 }
 /////////////////////////////////////////////////////////////////////////
+void Reservoir::GetTunnelFLow(size_t t, LaneGroup *G, double *flow) const {
+    GetTunnelFLow(t, G->base);
+}
+/////////////////////////////////////////////////////////////////////////
+void Reservoir::GetEndWater_Mm3(LaneState *x, double *water) const {
+    for(size_t l = 0; l < HERSS_LANES; l++) {
+        water[l] += x->res_Mm3[l];
+    }
+}
+/////////////////////////////////////////////////////////////////////////
 int Reservoir::WriteStateFile(FILE *fp) {
     // # NODE RESERVOIR IDNR NAME INIT_RES_FR
-    fprintf (fp, "NODE RESERVOIR %d %s %.5f\n", int(idnr), nodename.c_str() , this->S->res_fr[S->stps-1] );
+    fprintf (fp, "NODE RESERVOIR %d %s %.5f\n", int(idnr), nodename.c_str() , this->S->res_fr[(S->stps-1) & S->mask] );
      return 0; 
 }
 /////////////////////////////////////////////////////////////////////////
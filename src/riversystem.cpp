@@ -109,10 +109,15 @@ double Riversystem::GetEndingReservoirLevel(size_t r_idnr) {
         exit(EXIT_FAILURE);
     }
     
-    return this->reservoirs[r_idnr].S->res_fr[ gc->stps -1];
+    return this->reservoirs[r_idnr].S->res_fr[ (gc->stps -1) & reservoirs[r_idnr].S->mask ];
 }
 ///////////////////////////////////////////////////////////////////
 void Riversystem::PrintReservoirData2Screen() {
+    if(gc->vf_only) {
+        printf("ERROR: %s needs the output series, which are not stored with VF_ONLY\n", __FUNCTION__);
+        printf("file: %s  linenr: %d  function: %s \n", __FILE__ , __LINE__, __FUNCTION__);
+        exit(EXIT_FAILURE);
+    }
     printf("-----   reservoir fractions  -----  \n");
     for(size_t t = 0; t < gc->stps; t++) {
         for(size_t r = 0; r < gc->nr_reservoirs; r++) {
@@ -130,6 +135,11 @@ void Riversystem::PrintReservoirData2Screen() {
 }
 ///////////////////////////////////////////////////////////////////
 void Riversystem::WriteReservoirData() {
+    if(gc->vf_only) {
+        printf("ERROR: %s needs the output series, which are not stored with VF_ONLY\n", __FUNCTION__);
+        printf("file: %s  linenr: %d  function: %s \n", __FILE__ , __LINE__, __FUNCTION__);
+        exit(EXIT_FAILURE);
+    }
 
     FILE *fp;
     char outfilename [100];
@@ -152,7 +162,7 @@ void Riversystem::WriteReservoirData() {
     fprintf(fp,"\n");
 
     for(size_t t = 0; t < gc->stps; t++) {
-        fprintf(fp, "%d %d %d %d ", nodes[0]->S->year[t], nodes[0]->S->month[t], nodes[0]->S->day[t], nodes[0]->S->hour[t]);
+        fprintf(fp, "%d %d %d %d ", nodes[0]->timeaxis->year[t], nodes[0]->timeaxis->month[t], nodes[0]->timeaxis->day[t], nodes[0]->timeaxis->hour[t]);
         for(size_t n = 0; n < gc->nr_nodes; n++) {
             if(nodes[n]->nodetype == NodeType::RESERVOIR) {
                 fprintf(fp, "%.4f ", nodes[n]->S->res_fr[t] );
@@ -166,13 +176,11 @@ void Riversystem::WriteReservoirData() {
 }
 ///////////////////////////////////////////////////////////////////
 // This function returns income and penalties in the simulation period. 
-// Remaining water in the Riversystem is not included.
+// Remaining water in the Riversystem is not included. Present value as in CalcVF.
 double Riversystem::CalcSimulationProfit() {
     double sim_profit = 0.0;
     for(size_t n = 0; n < nr_nodes; n++) {
-        for(size_t t = 0; t < gc->stps; t++) {
-            sim_profit += (nodes[n]->S->income[t] - nodes[n]->S->cost[t]);
-        }
+        sim_profit += nodes[n]->S->pv_income_Euro - nodes[n]->S->pv_cost_Euro;
     }
     return sim_profit;
 }
@@ -185,74 +193,76 @@ double Riversystem::CalcVF(double restprice) {
     tot_income_Euro              = 0.0;
     tot_cost_Euro                = 0.0;
     tot_profit_Euro              = 0.0;
+    pv_remaining_available_Euro  = 0.0;
+    pv_income_Euro               = 0.0;
+    pv_cost_Euro                 = 0.0;
+    pv_profit_Euro               = 0.0;
     valuefunction_Euro           = 0.0;
     sum_production               = 0.0;
+    sum_qmin_cost                = 0.0;
+    sum_lrw_cost                 = 0.0;
+    sum_startstopcost            = 0.0;
+    sum_max_adjustment_cost      = 0.0;
 
     // At the most downstream node (OCEAN) the total available water 
     // is the node available water + upstream available (not included DEAD WATER)
-    tot_remaining_available_Mm3  = nodes[nr_nodes-1]->upstream_remaining_available_Mm3;
-    tot_remaining_available_Mm3 += nodes[nr_nodes-1]->remaining_available_Mm3;
+    tot_remaining_available_Mm3  = nodes[nr_nodes-1]->X->upstream_remaining_available_Mm3;
+    tot_remaining_available_Mm3 += nodes[nr_nodes-1]->X->remaining_available_Mm3;
     //printf("tot_remaining_available_Mm3 at outlet= %.4f\n", tot_remaining_available_Mm3);
 
-    // We now loop over the Powerstations and calculate the remaining energy and value. 
+    // The income, costs and production are summed in the Scenarios during the simulation. 
+    // The value function uses present values, see GlobalConfig::SetDiscount()
     for(size_t n = 0; n < nr_nodes; n++) {
+        Scenario *S = nodes[n]->S;
+        tot_income_Euro += S->sum_income_Euro;
+        tot_cost_Euro   += S->sum_cost_Euro;
+        pv_income_Euro  += S->pv_income_Euro;
+        pv_cost_Euro    += S->pv_cost_Euro;
+
         if(nodes[n]->nodetype == NodeType::POWERSTATION) { 
             // Powerstations has zero storage so only upstream water is needed. 
-            tot_remaining_available_MWh += (nodes[n]->local_energy_equivalent * nodes[n]->upstream_remaining_available_Mm3 * 1000000.0 / 1000.0); // MWh
-            for(size_t t = 0; t < gc->stps; t++) {
-                sum_production += nodes[n]->S->Power[t];
-            }
+            tot_remaining_available_MWh += (nodes[n]->local_energy_equivalent * nodes[n]->X->upstream_remaining_available_Mm3 * 1000000.0 / 1000.0); // MWh
+            sum_production          += S->sum_prod_MWh;
+            sum_startstopcost       += S->sum_cost_Euro - S->sum_adjust_cost_Euro;
+            sum_max_adjustment_cost += S->sum_adjust_cost_Euro;
         }
-    }
-
-    for(size_t n = 0; n < nr_nodes; n++) {
-        for(size_t t = 0; t < gc->stps; t++) {
-            tot_income_Euro += nodes[n]->S->income[t];
-            tot_cost_Euro  += nodes[n]->S->cost[t];
+        if(nodes[n]->nodetype == NodeType::CHANNEL) { 
+            sum_qmin_cost += S->sum_cost_Euro;
+        }
+        if(nodes[n]->nodetype == NodeType::RESERVOIR) { 
+            sum_lrw_cost += S->sum_cost_Euro;
         }
     }
 
     tot_remaining_available_Euro = tot_remaining_available_MWh*restprice;
     tot_profit_Euro = tot_income_Euro - tot_cost_Euro;
-    valuefunction_Euro = tot_profit_Euro + tot_remaining_available_Euro;
+    pv_remaining_available_Euro = tot_remaining_available_MWh*restprice*gc->discount[gc->stps];
+    pv_profit_Euro = pv_income_Euro - pv_cost_Euro;
+    valuefunction_Euro = pv_profit_Euro + pv_remaining_available_Euro;
 
-    sum_qmin_cost = 0.0;
-    for(size_t n = 0; n < nr_nodes; n++) {
-        if(nodes[n]->nodetype == NodeType::CHANNEL) { 
-            for(size_t t = 0; t < gc->stps; t++) {
-                sum_qmin_cost += nodes[n]->S->cost[t];
-            }
-        }
-    }
+    return valuefunction_Euro;
+}
+//////////////////////////////////////////////////////////////////////
+// Same value function as above, but for the results in an other SystemState. 
+// The sums are done in the same order, so the two functions give identical answers.
+double Riversystem::CalcVF(double restprice, SystemState *Y) const {
 
-    sum_lrw_cost = 0.0;
-    // We now loop over the RESERVOIRS 
-    for(size_t n = 0; n < nr_nodes; n++) {
-        if(nodes[n]->nodetype == NodeType::RESERVOIR) { 
-            for(size_t t = 0; t < gc->stps; t++) {
-                sum_lrw_cost += nodes[n]->S->cost[t];
-            }
-        }
-    }
+    double remaining_MWh = 0.0;
+    double income        = 0.0;
+    double cost          = 0.0;
 
-    sum_startstopcost = 0.0;
-    sum_max_adjustment_cost = 0.0;
     for(size_t n = 0; n < nr_nodes; n++) {
         if(nodes[n]->nodetype == NodeType::POWERSTATION) { 
-            for(size_t t = 0; t < gc->stps; t++) {
-                sum_startstopcost += nodes[n]->S->cost[t] - nodes[n]->S->adjust_cost[t];
-                sum_max_adjustment_cost += nodes[n]->S->adjust_cost[t];
-            }
+            remaining_MWh += (nodes[n]->local_energy_equivalent * Y->ns[n].upstream_remaining_available_Mm3 * 1000000.0 / 1000.0); // MWh
         }
     }
 
-    avg_price = 0.0;
-    for(size_t t = 0; t < gc->stps; t++) {
-        avg_price += nodes[0]->S->price[t];
+    for(size_t n = 0; n < nr_nodes; n++) {
+        income += Y->scen[n]->pv_income_Euro;
+        cost   += Y->scen[n]->pv_cost_Euro;
     }
-    avg_price = avg_price/double(gc->stps);
 
-    return valuefunction_Euro;
+    return (income - cost) + remaining_MWh*restprice*gc->discount[gc->stps];
 }
 ///////////////////////////////////////////////////////////////////
 int Riversystem::WriteRiverSystemData(double restprice) {
@@ -277,44 +287,7 @@ int Riversystem::WriteRiverSystemData(double restprice) {
             int(n), nodes[n]->nodename.c_str(), nodes[n]->nodetype, EnumToString(nodes[n]->nodetype) , nodes[n]->GetEndWater_Mm3() );
     }
   
-    tot_remaining_available_Mm3  = 0.0;
-    tot_remaining_available_MWh  = 0.0;
-    tot_remaining_available_Euro = 0.0;
-    tot_income_Euro              = 0.0;
-    tot_cost_Euro                = 0.0;
-    tot_profit_Euro              = 0.0;
-    valuefunction_Euro           = 0.0;
-    sum_production               = 0.0;
-
-    // At the most downstream node (OCEAN) the total available water 
-    // is the node available water + upstream available (not included DEAD WATER)
-    tot_remaining_available_Mm3  = nodes[nr_nodes-1]->upstream_remaining_available_Mm3;
-    tot_remaining_available_Mm3 += nodes[nr_nodes-1]->remaining_available_Mm3;
-
-    // Note that Powerstation cannot store water (remaining_available_Mm3 = 0.0), 
-    // so downstream accumulation of remaining water is OK. 
-
-    // We now loop over the Powerstations and calculate the remaining energy and value. 
-    for(size_t n = 0; n < nr_nodes; n++) {
-        if(nodes[n]->nodetype == NodeType::POWERSTATION) { 
-            // Powerstations has zero storage so only upstream water is needed. 
-            tot_remaining_available_MWh += (nodes[n]->local_energy_equivalent * nodes[n]->upstream_remaining_available_Mm3 * 1000000.0 / 1000.0); // MWh
-            for(size_t t = 0; t < gc->stps; t++) {
-                sum_production += nodes[n]->S->Power[t];
-            }
-        }
-    }
-
-    for(size_t n = 0; n < nr_nodes; n++) {
-        for(size_t t = 0; t < gc->stps; t++) {
-            tot_income_Euro += nodes[n]->S->income[t];
-            tot_cost_Euro  += nodes[n]->S->cost[t];
-        }
-    }
-
-    tot_remaining_available_Euro = tot_remaining_available_MWh*restprice;
-    tot_profit_Euro = tot_income_Euro - tot_cost_Euro;
-    valuefunction_Euro = tot_profit_Euro + tot_remaining_available_Euro;
+    CalcVF(restprice);
 
     fprintf(fp,"-------------------------------------------\n");
     fprintf(fp,"GLOBAL WATERBALANCE\n");
@@ -339,40 +312,9 @@ int Riversystem::WriteRiverSystemData(double restprice) {
     }
 
 
-    double sum_qmin_cost = 0.0;
-
-    for(size_t n = 0; n < nr_nodes; n++) {
-        if(nodes[n]->nodetype == NodeType::CHANNEL) { 
-            for(size_t t = 0; t < gc->stps; t++) {
-                sum_qmin_cost += nodes[n]->S->cost[t];
-            }
-        }
-    }
-
-    sum_lrw_cost = 0.0;
-    // We now loop over the RESERVOIRS
-    for(size_t n = 0; n < nr_nodes; n++) {
-        if(nodes[n]->nodetype == NodeType::RESERVOIR) { 
-            for(size_t t = 0; t < gc->stps; t++) {
-                sum_lrw_cost += nodes[n]->S->cost[t];
-            }
-        }
-    }
-
-    sum_startstopcost = 0.0;
-    sum_max_adjustment_cost = 0.0;
-    for(size_t n = 0; n < nr_nodes; n++) {
-        if(nodes[n]->nodetype == NodeType::POWERSTATION) { 
-            for(size_t t = 0; t < gc->stps; t++) {
-                sum_startstopcost += nodes[n]->S->cost[t] - nodes[n]->S->adjust_cost[t];
-                sum_max_adjustment_cost += nodes[n]->S->adjust_cost[t];
-            }
-        }
-    }
-
     avg_price = 0.0;
     for(size_t t = 0; t < gc->stps; t++) {
-        avg_price += nodes[0]->S->price[t];
+        avg_price += nodes[0]->timeaxis->price[t];
     }
     avg_price = avg_price/double(gc->stps);
 
@@ -390,6 +332,12 @@ int Riversystem::WriteRiverSystemData(double restprice) {
     fprintf(fp, "sum_max_adjustment_cost      = %.3f\n", sum_max_adjustment_cost);
     fprintf(fp, "tot_cost_Euro                = %.3f\n", tot_cost_Euro);
     fprintf(fp, "tot_profit_Euro              = %.3f\n", tot_profit_Euro);
+    if(gc->discount_rate != NOT_INIT) {
+        fprintf(fp, "pv_remaining_available_Euro  = %.3f\n", pv_remaining_available_Euro);
+        fprintf(fp, "pv_income_Euro               = %.3f\n", pv_income_Euro);
+        fprintf(fp, "pv_cost_Euro                 = %.3f\n", pv_cost_Euro);
+        fprintf(fp, "pv_profit_Euro               = %.3f\n", pv_profit_Euro);
+    }
     fprintf(fp, "valuefunction_Euro           = %.3f\n", valuefunction_Euro);
 
     fclose(fp);
@@ -409,6 +357,12 @@ int Riversystem::WriteRiverSystemData(double restprice) {
         printf("sum_max_adjustment_cost      = %.3f\n", sum_max_adjustment_cost);
         printf("tot_cost_Euro                = %.3f\n", tot_cost_Euro);
         printf("tot_profit_Euro              = %.3f\n", tot_profit_Euro);
+        if(gc->discount_rate != NOT_INIT) {
+            printf("pv_remaining_available_Euro  = %.3f\n", pv_remaining_available_Euro);
+            printf("pv_income_Euro               = %.3f\n", pv_income_Euro);
+            printf("pv_cost_Euro                 = %.3f\n", pv_cost_Euro);
+            printf("pv_profit_Euro               = %.3f\n", pv_profit_Euro);
+        }
         printf("valuefunction_Euro           = %.3f\n", valuefunction_Euro);
         printf("-----------------------------------\n");
     }
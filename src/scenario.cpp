@@ -29,14 +29,25 @@ SOFTWARE.
 
 #include "herss.h"
 
-Scenario::Scenario(){}
-
-Scenario::Scenario(size_t stps, size_t dt, size_t idnr){
-
-    this->stps = stps;
-    this->dt   = dt;
-    this->idnr = idnr;
-    restprice               = NOT_INIT;
+Scenario::Scenario(){
+    arena_mem = NULL;
+    arena     = NULL;
+}
+///////////////////////////////////////////////////////////////////////////////
+// All the series are carved out of one arena. With arena = NULL the Scenario allocates 
+// its own, else arena must hold ArenaSize(stps, nodetype, vf_only) bytes, start on a HERSS_ALIGN byte 
+// boundary and outlive the Scenario. This way a SystemState can keep all its Scenarios in one block.
+// Only the series used by nodetype are allocated, the others are NULL. With vf_only the 
+// output series are rings of HERSS_VF_RING timesteps, see mask. With own_input false there 
+// is no room for the input series, and they must be set with ViewInput(). 
+// The price and calendar are not here, but in TimeAxis.
+Scenario::Scenario(size_t stps, size_t dt, size_t idnr, NodeType nodetype, bool vf_only, bool own_input, char *arena){
+
+    this->stps   = stps;
+    this->dt     = dt;
+    this->idnr   = idnr;
+    this->stored = (vf_only && stps > HERSS_VF_RING) ? HERSS_VF_RING : stps;
+    this->mask   = (this->stored < stps) ? HERSS_VF_RING - 1 : ~size_t(0);
     broken_lrw  = false;
     broken_qmin = false;
     days_with_production    = NOT_INIT;
@@ -53,123 +64,139 @@ Scenario::Scenario(size_t stps, size_t dt, size_t idnr){
     sum_local_inflow_Mm3    = NOT_INIT;
     sum_total_energy_MWh    = NOT_INIT;
     sum_overflow_Mm3        = NOT_INIT;
+    ResetSums();
+
+    arena_mem = NULL;
+    if(arena == NULL) {
+        try {
+            arena_mem = new char[ArenaSize(stps, nodetype, vf_only, own_input) + HERSS_ALIGN];
+        }
+        catch(std::bad_alloc& exc) {
+            printf("Error: memory allocation failed. \n"); 
+            printf("file: %s  linenr: %d  function: %s \n", __FILE__ , __LINE__, __FUNCTION__);
+            exit(EXIT_FAILURE);
+        }
+        arena = AlignArena(arena_mem);
+    }
+    this->arena = arena;
+
+    // The layout of the arena, first the input series, then the output series of all nodes 
+    // and of the node type.
+    double **input_series[] = { &action, &inflow };
+    double **base_series[] = { &up_inflow, &tot_outflow, &income, &cost };
+    double **reservoir_series[] = { &tot_inflow, &res_Mm3, &res_masl, &res_fr, &overflow_Mm3, 
+        &tunnelflow_m3s, &hatchflow_m3s, &overflow_m3s, &auto_qmin_m3s };
+    double **powerstation_series[] = { &profit, &Hbrutto, &Hnetto, &Power, &auto_qmin_m3s, &adjust_cost };
+    double **channel_series[] = { &cost_qmin, &channel_storage_Mm3 };
+    static_assert(sizeof(input_series)/sizeof(input_series[0])               == SCENARIO_INPUT_SERIES,        "SCENARIO_INPUT_SERIES");
+    static_assert(sizeof(base_series)/sizeof(base_series[0])                 == SCENARIO_BASE_SERIES,         "SCENARIO_BASE_SERIES");
+    static_assert(sizeof(reservoir_series)/sizeof(reservoir_series[0])       == SCENARIO_RESERVOIR_SERIES,    "SCENARIO_RESERVOIR_SERIES");
+    static_assert(sizeof(powerstation_series)/sizeof(powerstation_series[0]) == SCENARIO_POWERSTATION_SERIES, "SCENARIO_POWERSTATION_SERIES");
+    static_assert(sizeof(channel_series)/sizeof(channel_series[0])           == SCENARIO_CHANNEL_SERIES,      "SCENARIO_CHANNEL_SERIES");
+
+    for(size_t k = 0; k < SCENARIO_RESERVOIR_SERIES; k++) {
+        *reservoir_series[k] = NULL;
+    }
+    for(size_t k = 0; k < SCENARIO_POWERSTATION_SERIES; k++) {
+        *powerstation_series[k] = NULL;
+    }
+    for(size_t k = 0; k < SCENARIO_CHANNEL_SERIES; k++) {
+        *channel_series[k] = NULL;
+    }
 
-    try {
-        price           = new double[stps];
-        action          = new double[stps];
-        q_action        = new double[stps];
-        inflow          = new double[stps];
-        tot_outflow     = new double[stps];
-        tot_inflow      = new double[stps];
-        local_inflow    = new double[stps];
-        up_inflow       = new double[stps];
-        res_Mm3         = new double[stps];
-        res_masl        = new double[stps];
-        res_fr          = new double[stps];
-        profit          = new double[stps];
-        overflow_Mm3    = new double[stps];
-        income          = new double[stps];
-        cost            = new double[stps];
-        cost_qmin       = new double[stps];
-        startStopCost   = new double[stps];
-        cost_lrw        = new double[stps];
-        cost_fake_lrw   = new double[stps];
-        Hbrutto         = new double[stps];
-        Hnetto          = new double[stps];
-        Power           = new double[stps];
-
-        tunnelflow_m3s  = new double[stps];
-        hatchflow_m3s   = new double[stps];
-        overflow_m3s    = new double[stps];
-        auto_qmin_m3s   = new double[stps];
-        channel_storage_Mm3 = new double[stps];
-        adjust_cost         = new double[stps];
-
-        year            = new int[stps];
-        month           = new int[stps];
-        day             = new int[stps];
-        hour            = new int[stps];
-        qmin_flag       = new int[stps];
+    double ***type_series = reservoir_series;
+    if(nodetype == NodeType::POWERSTATION) {
+        type_series = powerstation_series;
     }
-    catch(std::bad_alloc& exc) {
-        printf("Error: memory allocation failed. \n"); 
-        printf("file: %s  linenr: %d  function: %s \n", __FILE__ , __LINE__, __FUNCTION__);
-		exit(EXIT_FAILURE);
+    if(nodetype == NodeType::CHANNEL) {
+        type_series = channel_series;
     }
 
-    for(size_t t = 0; t < this->stps; t++) {
-        price[t]           = NOT_INIT;
-        action[t]          = NOT_INIT;
-        q_action[t]        = NOT_INIT;
-        inflow[t]          = 0.0;     // To make things easy and faster 
-        tot_outflow[t]     = NOT_INIT;
-        tot_inflow[t]      = NOT_INIT;
-        local_inflow[t]    = NOT_INIT;
-        up_inflow[t]       = 0.0;        // To make things easy and faster 
-        res_Mm3[t]         = NOT_INIT;
-        res_masl[t]        = NOT_INIT;
-        res_fr[t]          = NOT_INIT;
-        profit[t]          = NOT_INIT;
-        overflow_Mm3[t]    = NOT_INIT;
-        income[t]          = NOT_INIT;
-        cost[t]            = NOT_INIT;
-        cost_qmin[t]       = NOT_INIT;
-        startStopCost[t]   = NOT_INIT;
-        cost_lrw[t]        = NOT_INIT;
-        cost_fake_lrw[t]   = NOT_INIT;
-        Hbrutto[t]         = NOT_INIT;
-        Hnetto[t]          = NOT_INIT;
-        Power[t]           = NOT_INIT;
-        year[t]            = NOT_INIT;
-        month[t]           = NOT_INIT;
-        day[t]             = NOT_INIT;
-        hour[t]            = NOT_INIT;
-        qmin_flag[t]       = NOT_INIT;
-        adjust_cost[t]     = 0.0;
+    size_t nr_input  = own_input ? SCENARIO_INPUT_SERIES : 0;
+    size_t nr_output = NrOutputSeries(nodetype);
+    size_t dstride   = SeriesStride(stps, sizeof(double));
+    size_t ostride   = SeriesStride(stored, sizeof(double));
+    double *d = (double *) arena;
+    double *o = d + nr_input*dstride;
+    for(size_t k = 0; k < SCENARIO_INPUT_SERIES; k++) {
+        *input_series[k] = own_input ? d + k*dstride : NULL;
+    }
+    for(size_t k = 0; k < nr_output; k++) {
+        if(k < SCENARIO_BASE_SERIES) {
+            *base_series[k] = o + k*ostride;
+        } else {
+            *type_series[k - SCENARIO_BASE_SERIES] = o + k*ostride;
+        }
+    }
 
-        tunnelflow_m3s[t]  = NOT_INIT;
-        hatchflow_m3s[t]   = NOT_INIT;
-        overflow_m3s[t]    = NOT_INIT;
-        auto_qmin_m3s[t]   = NOT_INIT;
-        channel_storage_Mm3[t] = NOT_INIT;
+    // Everything is NOT_INIT, except the series the nodes add (+=) to, which are zero to make things easy and faster. 
+    for(size_t k = 0; k < nr_input*dstride + nr_output*ostride; k++) {
+        d[k] = NOT_INIT;
+    }
+    for(size_t t = 0; t < this->stps && own_input; t++) {
+        inflow[t] = 0.0;
+    }
+    for(size_t t = 0; t < this->stored; t++) {
+        up_inflow[t] = 0.0;
+    }
+    if(adjust_cost != NULL) {
+        for(size_t t = 0; t < this->stored; t++) {
+            adjust_cost[t] = 0.0;
+        }
     }
 }
 ///////////////////////////////////////////////////////////////////////////////
+// Each series is padded to a multiple of HERSS_ALIGN bytes, so they all start aligned.
+size_t Scenario::SeriesStride(size_t stps, size_t size) {
+    size_t per_line = HERSS_ALIGN/size;
+    return ((stps + per_line - 1)/per_line)*per_line;
+}
+///////////////////////////////////////////////////////////////////////////////
+// The output series, the input series are the same for all node types.
+size_t Scenario::NrOutputSeries(NodeType nodetype) {
+    switch(nodetype) {
+        case NodeType::RESERVOIR:    return SCENARIO_BASE_SERIES + SCENARIO_RESERVOIR_SERIES;
+        case NodeType::POWERSTATION: return SCENARIO_BASE_SERIES + SCENARIO_POWERSTATION_SERIES;
+        case NodeType::CHANNEL:      return SCENARIO_BASE_SERIES + SCENARIO_CHANNEL_SERIES;
+    }
+    return SCENARIO_BASE_SERIES;
+}
+///////////////////////////////////////////////////////////////////////////////
+size_t Scenario::ArenaSize(size_t stps, NodeType nodetype, bool vf_only, bool own_input) {
+    size_t stored = (vf_only && stps > HERSS_VF_RING) ? HERSS_VF_RING : stps;
+    size_t output = NrOutputSeries(nodetype)*SeriesStride(stored, sizeof(double))*sizeof(double);
+    if(!own_input) {
+        return output;
+    }
+    return SCENARIO_INPUT_SERIES*SeriesStride(stps, sizeof(double))*sizeof(double) + output;
+}
+///////////////////////////////////////////////////////////////////////////////
+// Use the series in data as input, without copying them. Changes to the input, e.g. 
+// Herss::SetAction(), are then made in data, and data must outlive the Scenario.
+void Scenario::ViewInput(Dataset *data) {
+    action = data->action[idnr];
+    inflow = data->inflow[idnr];
+}
+///////////////////////////////////////////////////////////////////////////////
+// mem must have room for HERSS_ALIGN extra bytes.
+char *Scenario::AlignArena(char *mem) {
+    size_t offset = size_t(mem) % HERSS_ALIGN;
+    return (offset == 0) ? mem : mem + (HERSS_ALIGN - offset);
+}
+///////////////////////////////////////////////////////////////////////////////
+void Scenario::ResetSums() {
+    sum_prod_MWh          = 0.0;
+    sum_income_Euro       = 0.0;
+    sum_cost_Euro         = 0.0;
+    sum_local_inflow_Mm3  = 0.0;
+    pv_income_Euro        = 0.0;
+    pv_cost_Euro          = 0.0;
+    sum_adjust_cost_Euro  = 0.0;
+    sum_inflow_Mm3        = 0.0;
+    sum_outflow_Mm3       = 0.0;
+}
+///////////////////////////////////////////////////////////////////////////////
 Scenario::~Scenario(){
-
-    delete [] price;
-    delete [] action;
-    delete [] q_action;
-    delete [] inflow;
-    delete [] tot_outflow;
-    delete [] tot_inflow;
-    delete [] local_inflow;
-    delete [] up_inflow;
-    delete [] res_Mm3;
-    delete [] res_masl;
-    delete [] res_fr;
-    delete [] profit;
-    delete [] overflow_Mm3;
-    delete [] income;
-    delete [] cost;
-    delete [] cost_qmin;
-    delete [] startStopCost;
-    delete [] cost_lrw;
-    delete [] cost_fake_lrw;
-    delete [] Hbrutto;
-    delete [] Hnetto;
-    delete [] Power;
-    delete [] year;
-    delete [] month;
-    delete [] day;
-    delete [] hour;
-    delete [] qmin_flag;
-    delete [] tunnelflow_m3s;
-    delete [] hatchflow_m3s;
-    delete [] overflow_m3s;
-    delete [] auto_qmin_m3s;
-    delete [] channel_storage_Mm3;
-    delete [] adjust_cost;
-
+    delete [] arena_mem;
 }
 ///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,103 @@
+/********************************************************************************
+Project:      The Hydraulic Economic River System Simulator (HERSS)
+Filename:     systemstate.cpp                                                     
+Developer:    Bernt Viggo Matheussen (Bernt.Viggo.Matheussen@aenergi.no)
+Organization: Å Energi, www.ae.no
+
+This software is released under the MIT license:
+
+Copyright (c) <2024> <Å Energi, Bernt Viggo Matheussen>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+********************************************************************************/
+
+#include "herss.h"
+
+NodeState::NodeState() {
+    S                                = NULL;
+    res_Mm3                          = NOT_INIT;
+    res_masl                         = NOT_INIT;
+    res_fr                           = NOT_INIT;
+    up_res_Mm3                       = NOT_INIT;
+    start_of_stp_masl                = NOT_INIT;
+    end_of_stp_masl                  = NOT_INIT;
+    remaining_available_Mm3          = NOT_INIT;
+    upstream_remaining_available_Mm3 = 0.0; // To make things easier. 
+    for(size_t s = 0; s < MAX_TRAVELTIME_HOURS; s++) {
+        waterflow_m3[s] = NOT_INIT;
+    }
+    channel_head       = 0;
+    channel_storage_m3 = NOT_INIT;
+    nr_adjustments     = 0;
+}
+
+NodeState::~NodeState() {}
+
+///////////////////////////////////////////////////////////////////////////////
+SystemState::SystemState(GlobalConfig *gc, bool own_input) {
+
+    this->nr_nodes = gc->nr_nodes;
+    this->stps     = gc->stps;
+
+    // The Scenarios of all nodes share one allocation, so a new SystemState costs one 
+    // allocation for the series and they are found next to each other in memory.
+    // Each node type has its own layout, and with VF_ONLY the output series are short, 
+    // see Scenario::ArenaSize().
+    size_t arena_size = 0;
+    for(size_t n = 0; n < nr_nodes; n++) {
+        arena_size += Scenario::ArenaSize(stps, gc->nodetypes[n], gc->vf_only, own_input);
+    }
+    try {
+        ns        = new NodeState[nr_nodes];
+        scen      = new Scenario*[nr_nodes];
+        arena_mem = new char[arena_size + HERSS_ALIGN];
+        char *arena = Scenario::AlignArena(arena_mem);
+        for(size_t n = 0; n < nr_nodes; n++) {
+            scen[n] = new Scenario(gc->stps, gc->dt, n, gc->nodetypes[n], gc->vf_only, own_input, arena);
+            ns[n].S = scen[n];
+            arena += Scenario::ArenaSize(stps, gc->nodetypes[n], gc->vf_only, own_input);
+        }
+    }
+    catch(std::bad_alloc& exc) {
+        printf("Error: memory allocation failed. \n"); 
+        printf("file: %s  linenr: %d  function: %s \n", __FILE__ , __LINE__, __FUNCTION__);
+        exit(EXIT_FAILURE);
+    }
+}
+///////////////////////////////////////////////////////////////////////////////
+SystemState::~SystemState() {
+    for(size_t n = 0; n < nr_nodes; n++) {
+        delete scen[n];
+    }
+    delete [] scen;
+    delete [] ns;
+    delete [] arena_mem;
+}
+///////////////////////////////////////////////////////////////////////////////
+// We copy the input series, so that a simulation stored in this state use the 
+// same inflow and actions as the one in src. The price and calendar are in Herss::timeaxis.
+void SystemState::CopyInput(SystemState *src) {
+    for(size_t n = 0; n < nr_nodes; n++) {
+        Scenario *from = src->scen[n];
+        Scenario *to   = this->scen[n];
+        memcpy(to->inflow, from->inflow, stps*sizeof(double));
+        memcpy(to->action, from->action, stps*sizeof(double));
+    }
+}
+///////////////////////////////////////////////////////////////////////////////